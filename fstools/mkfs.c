@@ -5,7 +5,7 @@
 // target architecture
 //
 // Expected parameters:
-// output_file block_count kernel [other files]
+// [-b block_size] output_file block_count boot_sect kernel [other files]
 
 #include <stdio.h>
 #include <unistd.h>
@@ -29,16 +29,22 @@ typedef unsigned int uint32_t;
 // Output file descriptor
 int fsfd = 0;
 
+// Block size in bytes
+int block_size = BLOCK_SIZE;
+
 // Write and read blocks
 void wblock(uint, void*);
 void rblock(uint sec, void *buf);
 
+// Directory reference to an entry
+uint32_t dir_ref(uint32_t n, char* name);
+
 // Entry point
 int main(int argc, char *argv[])
 {
   int i=0, f=0, e=0, b=0, cc=0, fd=0;
   char* name = NULL;
-  char buf[BLOCK_SIZE];
+  char buf[SFS_MAXBLOCKSIZE];
   sfs_superblock_t sfs_sb;
   sfs_entry_t* sfs_entry = NULL;
 
@@ -48,10 +54,25 @@ int main(int argc, char *argv[])
   assert(BLOCK_SIZE % sizeof(sfs_entry_t) == 0 ||
          sizeof(sfs_entry_t) % BLOCK_SIZE == 0);
 
+  // Optional block size
+  if(argc > 2 && strcmp(argv[1], "-b") == 0) {
+    block_size = atoi(argv[2]);
+    if(block_size < BLOCK_SIZE || block_size > SFS_MAXBLOCKSIZE ||
+      (block_size & (block_size - 1))) {
+      fprintf(stderr, "%s: block size must be a power of 2 from %d to %d\n",
+        argv[0], BLOCK_SIZE, SFS_MAXBLOCKSIZE);
+      exit(1);
+    }
+    // Skip the option, keeping the program name in argv[0]
+    argv[2] = argv[0];
+    argv += 2;
+    argc -= 2;
+  }
+
   // Check usage
   if(argc < 5) {
     fprintf(stderr,
-      "Usage: %s output_file fs_size_blocks boot_sect kernel_file [other_files ...]\n",
+      "Usage: %s [-b block_size] output_file fs_size_blocks boot_sect kernel_file [other_files ...]\n",
       argv[0]);
 
     exit(1);
@@ -59,8 +80,19 @@ int main(int argc, char *argv[])
 
   // Get fs parameters
   int fssize_blocks = atoi(argv[2]);  // Size of file system in blocks
-  int numentries = min(((fssize_blocks * BLOCK_SIZE)/10)/sizeof(sfs_entry_t), 4096);
+  if(fssize_blocks > SFS_MAXBLOCKS) {
+    fprintf(stderr, "%s: size limited to %ld blocks\n", argv[0],
+      SFS_MAXBLOCKS);
+    fssize_blocks = SFS_MAXBLOCKS;
+  }
+  int numentries = min((fssize_blocks/10)*(block_size/sizeof(sfs_entry_t)), 4096);
   int entries_size = numentries * sizeof(sfs_entry_t);
+  int entries_blocks = (entries_size + block_size - 1) / block_size;
+  int bitmap_blocks = (fssize_blocks + SFS_BITMAPBITS(block_size) - 1) /
+    SFS_BITMAPBITS(block_size);
+  int entrymap_blocks = (numentries + SFS_BITMAPBITS(block_size) - 1) /
+    SFS_BITMAPBITS(block_size);
+  char* bitmap = NULL;
 
   // Open output file
   fsfd = open(argv[1], O_RDWR|O_CREAT|O_TRUNC, 0666);
@@ -80,9 +112,9 @@ int main(int argc, char *argv[])
 
   read(fd, buf, 512);
   close(fd);
-  wblock(0, buf);
 
   // Write all image with 0s
+  wblock(0, buf);
   memset(buf, 0, sizeof(buf));
   for(i = 1; i < fssize_blocks; i++)
     wblock(i, buf);
@@ -91,13 +123,16 @@ int main(int argc, char *argv[])
   sfs_sb.type = SFS_TYPE_ID;
   sfs_sb.size = fssize_blocks;
   sfs_sb.nentries = numentries;
-  sfs_sb.bootstart = 2 + entries_size/BLOCK_SIZE;
+  sfs_sb.bitmapstart = SFS_ENTRIESSTART(block_size) + entries_blocks;
+  sfs_sb.bitmapblocks = bitmap_blocks;
+  sfs_sb.entrymapstart = sfs_sb.bitmapstart + sfs_sb.bitmapblocks;
+  sfs_sb.entrymapblocks = entrymap_blocks;
+  sfs_sb.bootstart = sfs_sb.entrymapstart + sfs_sb.entrymapblocks;
+  sfs_sb.blocksize = block_size;
 
-  memmove(buf, &sfs_sb, sizeof(sfs_sb));
-  wblock(1, buf);
-
-  printf("%s: creating %s (size=%d nentries=%d bootstart=%d)\n",
-    argv[0], argv[1], sfs_sb.size, sfs_sb.nentries, sfs_sb.bootstart);
+  printf("%s: creating %s (size=%d blocksize=%d nentries=%d bootstart=%d)\n",
+    argv[0], argv[1], sfs_sb.size, block_size, sfs_sb.nentries,
+    sfs_sb.bootstart);
 
   // Create empty entries table
   sfs_entry = malloc(entries_size);
@@ -133,53 +168,70 @@ int main(int argc, char *argv[])
       name++;
     }
 
-    // Create first file entry
-    sfs_entry[0].ref[f - 4] = e;
-
+    // Create file entry
     strncpy(sfs_entry[e].name, name, SFS_NAMESIZE-1);
-    sfs_entry[e].flags = T_FILE;
+    sfs_entry[0].ref[f - 4] = dir_ref(e, (char*)sfs_entry[e].name);
+
+    sfs_entry[e].flags = T_FILE | F_EXTENTS;
     sfs_entry[e].time = 0;
     sfs_entry[e].size = 0;
     sfs_entry[e].parent = 0;
     sfs_entry[e].next = 0;
 
+    // Small files are stored inline, except the boot program
+    cc = read(fd, buf, block_size);
+    if(f > 4 && cc >= 0 && cc <= SFS_INLINESIZE && read(fd, buf+cc, 1) == 0) {
+      sfs_entry[e].flags = T_FILE | F_INLINE;
+      sfs_entry[e].size = cc;
+      memmove(sfs_entry[e].ref, buf, cc);
+      close(fd);
+      e++;
+      continue;
+    }
+    lseek(fd, 0, SEEK_SET);
 
-    // Read file, write data block, and add more entries
-    // when there is no room for more refs in current entry
-    i = 0;
-
-    while((cc = read(fd, buf, BLOCK_SIZE)) > 0) {
-      int ec = e + (sfs_entry[e].size / (SFS_ENTRYREFS*BLOCK_SIZE));
-      if(e != ec && sfs_entry[ec].name[0] == 0) {
-        strncpy(sfs_entry[ec].name, sfs_entry[e].name, SFS_NAMESIZE-1);
-        sfs_entry[ec-1].next = ec;
-        sfs_entry[ec].flags = T_FILE;
-        sfs_entry[ec].time = 0;
-        sfs_entry[ec].size = 0;
-        sfs_entry[ec].parent = ec-1;
-        sfs_entry[ec].next = 0;
-        i = 0;
-      }
-
-      sfs_entry[ec].ref[i] = b;
-      wblock(sfs_entry[ec].ref[i], buf);
-      while(ec >= e) {
-        sfs_entry[ec].size += cc;
-        ec--;
-      }
-      i++;
+    // Read file and write data blocks contiguously,
+    // so the file is a single extent
+    sfs_entry[e].ref[0] = b;
+    sfs_entry[e].ref[1] = 0;
+
+    while((cc = read(fd, buf, block_size)) > 0) {
+      wblock(b, buf);
+      sfs_entry[e].size += cc;
+      sfs_entry[e].ref[1]++;
       b++;
     }
 
-    close(fd);
-
-    while(sfs_entry[e].name[0]) {
-      e++;
+    if(sfs_entry[e].ref[1] == 0) {
+      sfs_entry[e].ref[0] = 0;
     }
+
+    close(fd);
+    e++;
   }
 
+  // Write blocks bitmap. Blocks before b are used
+  bitmap = malloc(bitmap_blocks * block_size);
+  memset(bitmap, 0, bitmap_blocks * block_size);
+  for(i = 0; i < b; i++)
+    bitmap[i/8] |= (1 << (i%8));
+
+  for(i = 0; i < bitmap_blocks; i++)
+    wblock(sfs_sb.bitmapstart + i, &bitmap[i*block_size]);
+
+  // Write entries bitmap. Entries before e are used
+  free(bitmap);
+  bitmap = malloc(entrymap_blocks * block_size);
+  memset(bitmap, 0, entrymap_blocks * block_size);
+  for(i = 0; i < e; i++)
+    bitmap[i/8] |= (1 << (i%8));
+
+  for(i = 0; i < entrymap_blocks; i++)
+    wblock(sfs_sb.entrymapstart + i, &bitmap[i*block_size]);
+
   // Write entries table
-  if(lseek(fsfd, 2*BLOCK_SIZE, 0) != 2*BLOCK_SIZE) {
+  i = SFS_ENTRIESSTART(block_size) * block_size;
+  if(lseek(fsfd, i, 0) != i) {
     perror("lseek");
     exit(1);
   }
@@ -189,8 +241,21 @@ int main(int argc, char *argv[])
     exit(1);
   }
 
+  // Write superblock, always the second sector.
+  // Entries from e on were never used
+  sfs_sb.entryhwm = e;
+  if(lseek(fsfd, 512, 0) != 512) {
+    perror("lseek");
+    exit(1);
+  }
+  if(write(fsfd, &sfs_sb, sizeof(sfs_sb)) != sizeof(sfs_sb)) {
+    perror("write");
+    exit(1);
+  }
+
   // Done! Free memory, close file, and exit
   free(sfs_entry);
+  free(bitmap);
   close(fsfd);
 
   exit(0);
@@ -199,11 +264,11 @@ int main(int argc, char *argv[])
 // Write block
 void wblock(uint bindex, void* buf)
 {
-  if(lseek(fsfd, bindex*BLOCK_SIZE, 0) != bindex*BLOCK_SIZE) {
+  if(lseek(fsfd, bindex*block_size, 0) != bindex*block_size) {
     perror("lseek");
     exit(1);
   }
-  if(write(fsfd, buf, BLOCK_SIZE) != BLOCK_SIZE) {
+  if(write(fsfd, buf, block_size) != block_size) {
     perror("write");
     exit(1);
   }
@@ -212,12 +277,23 @@ void wblock(uint bindex, void* buf)
 // Read block
 void rblock(uint bindex, void* buf)
 {
-  if(lseek(fsfd, bindex*BLOCK_SIZE, 0) != bindex*BLOCK_SIZE) {
+  if(lseek(fsfd, bindex*block_size, 0) != bindex*block_size) {
     perror("lseek");
     exit(1);
   }
-  if(read(fsfd, buf, BLOCK_SIZE) != BLOCK_SIZE) {
+  if(read(fsfd, buf, block_size) != block_size) {
     perror("read");
     exit(1);
   }
 }
+
+// Directory reference to entry n, with the hash
+// of its name in the high 16 bits. See fs.h
+uint32_t dir_ref(uint32_t n, char* name)
+{
+  uint32_t hash = 0;
+  while(*name) {
+    hash = (hash*31 + (unsigned char)*name++) & 0xFFFF;
+  }
+  return (hash << 16) | n;
+}
@@ -0,0 +1,531 @@
+/*
+ * ATA disks
+ */
+
+#include "types.h"
+#include "kernel.h"
+#include "hw86.h"
+#include "ulib/ulib.h"
+#include "pci.h"
+#include "ata.h"
+
+/* Registers, relative to channel base port */
+#define ATA_DATA    0
+#define ATA_ERROR   1
+#define ATA_NSECT   2
+#define ATA_LBA0    3
+#define ATA_LBA1    4
+#define ATA_LBA2    5
+#define ATA_DRIVE   6
+#define ATA_STATUS  7
+#define ATA_COMMAND 7
+
+/* Control and alternate status register, relative to channel control port */
+#define ATA_CONTROL   0
+#define ATA_ALTSTATUS 0
+
+/* Status register bits */
+#define ATA_SR_ERR 0x01 /* Error */
+#define ATA_SR_DRQ 0x08 /* Data request */
+#define ATA_SR_DF  0x20 /* Device fault */
+#define ATA_SR_BSY 0x80 /* Busy */
+
+/* Commands */
+#define ATA_CMD_READ_SECTORS   0x20
+#define ATA_CMD_WRITE_SECTORS  0x30
+#define ATA_CMD_READ_MULTIPLE  0xC4
+#define ATA_CMD_WRITE_MULTIPLE 0xC5
+#define ATA_CMD_SET_MULTIPLE   0xC6
+#define ATA_CMD_READ_DMA       0xC8
+#define ATA_CMD_WRITE_DMA      0xCA
+#define ATA_CMD_IDENTIFY       0xEC
+
+/* Bus master IDE registers, relative to channel bus master base port */
+#define BM_COMMAND 0
+#define BM_STATUS  2
+#define BM_PRDT    4
+
+#define BM_CMD_START 0x01 /* Start transfer */
+#define BM_CMD_READ  0x08 /* Transfer from device to memory */
+#define BM_SR_ACTIVE 0x01 /* Transfer in progress */
+#define BM_SR_ERR    0x02 /* Error */
+#define BM_SR_IRQ    0x04 /* Device raised interrupt */
+
+/* Physical region descriptor table. Regions must not cross a 64KB
+ * bound, so three entries are enough for any transfer of up to 255
+ * sectors. The table must be aligned to 4 bytes and must not cross
+ * a 64KB bound either */
+#define ATA_PRDT_SIZE 24
+
+#define ATA_TIMEOUT      1000 /* Max time waiting for a device (ms) */
+#define ATA_MAX_MULTIPLE 16   /* Max sectors transferred per data block */
+
+static struct ata_device {
+  uint  present;
+  uint  base;     /* Channel base port */
+  uint  control;  /* Channel control port */
+  uint  slave;    /* 0 for master, 1 for slave */
+  uint  multiple; /* Sectors transferred per data block */
+  uint  dma;      /* 1 if DMA can be used */
+  ul_t  sectors;  /* Number of addressable sectors (LBA28) */
+} ata_device[ATA_MAX_DEVICES];
+
+static uint ata_bmide = 0; /* Bus master IDE base port, or 0 if no DMA */
+static ata_request_t* ata_active[2]; /* Request in progress of each channel */
+static uchar ata_prdt_buff[2][2*ATA_PRDT_SIZE+4];
+static uint16_t ata_id_buff[SECTOR_SIZE/2]; /* IDENTIFY data */
+
+extern void install_ata_IRQ_handlers();
+
+/*
+ * Select device and wait 400ns for it to respond
+ * head contains LBA bits 24-27
+ */
+static void ata_select(struct ata_device* d, uint head)
+{
+  uint i = 0;
+  outb((uchar)(0xE0 | (d->slave << 4) | (head & 0x0F)), d->base + ATA_DRIVE);
+  for(i=0; i<4; i++) {
+    inb(d->control + ATA_ALTSTATUS);
+  }
+}
+
+/*
+ * Wait until device is not busy
+ * Returns its status, or ATA_SR_BSY on timeout
+ */
+static uint ata_wait(struct ata_device* d)
+{
+  ul_t start = system_timer_ms;
+  uint status = 0;
+
+  do {
+    status = inb(d->base + ATA_STATUS);
+    if(!(status & ATA_SR_BSY)) {
+      return status;
+    }
+  } while(system_timer_ms - start < ATA_TIMEOUT);
+
+  return ATA_SR_BSY;
+}
+
+/*
+ * Wait until device requests a data transfer
+ * Returns 0 on success, ERROR_IO on error or timeout
+ */
+static uint ata_wait_drq(struct ata_device* d)
+{
+  uint status = ata_wait(d);
+  if((status & (ATA_SR_BSY | ATA_SR_ERR | ATA_SR_DF)) ||
+    !(status & ATA_SR_DRQ)) {
+    return ERROR_IO;
+  }
+  return 0;
+}
+
+/*
+ * Identify device and enable multiple mode
+ * Returns 0 if it's an usable ATA disk, ERROR_NOT_FOUND otherwise
+ */
+static uint ata_identify(struct ata_device* d)
+{
+  uint16_t* id = ata_id_buff;
+  uint status = 0;
+
+  ata_select(d, 0);
+  if(inb(d->base + ATA_STATUS) == 0xFF) { /* Floating bus */
+    return ERROR_NOT_FOUND;
+  }
+
+  outb(0, d->base + ATA_NSECT);
+  outb(0, d->base + ATA_LBA0);
+  outb(0, d->base + ATA_LBA1);
+  outb(0, d->base + ATA_LBA2);
+  outb(ATA_CMD_IDENTIFY, d->base + ATA_COMMAND);
+  if(inb(d->base + ATA_STATUS) == 0) { /* No device */
+    return ERROR_NOT_FOUND;
+  }
+
+  /* ATAPI and SATA devices abort and set a signature */
+  ata_wait(d);
+  if(inb(d->base + ATA_LBA1) != 0 || inb(d->base + ATA_LBA2) != 0) {
+    return ERROR_NOT_FOUND;
+  }
+
+  if(ata_wait_drq(d) != 0) {
+    return ERROR_NOT_FOUND;
+  }
+  insw_lmem(d->base + ATA_DATA, lp(ata_id_buff), SECTOR_SIZE/2);
+
+  /* Only LBA is supported */
+  if(!(id[49] & 0x0200)) {
+    return ERROR_NOT_FOUND;
+  }
+  d->sectors = (ul_t)id[60] | ((ul_t)id[61] << 16);
+  d->dma = (id[49] & 0x0100) ? 1 : 0;
+
+  /* Max sectors per block of READ/WRITE MULTIPLE is in word 47.
+   * Use the biggest power of 2 below it and ATA_MAX_MULTIPLE */
+  d->multiple = ATA_MAX_MULTIPLE;
+  while(d->multiple > (id[47] & 0xFF)) {
+    d->multiple /= 2;
+  }
+
+  if(d->multiple > 1) {
+    ata_select(d, 0);
+    outb((uchar)d->multiple, d->base + ATA_NSECT);
+    outb(ATA_CMD_SET_MULTIPLE, d->base + ATA_COMMAND);
+    status = ata_wait(d);
+    if(status & (ATA_SR_BSY | ATA_SR_ERR | ATA_SR_DF)) {
+      d->multiple = 1;
+    }
+  }
+
+  if(d->multiple == 0) {
+    d->multiple = 1;
+  }
+
+  return 0;
+}
+
+/*
+ * Initialize ATA
+ */
+void ata_init()
+{
+  pci_device_t* pdev = 0;
+  uint i = 0;
+  uint dev = 0;
+  ul_t bios_sectors = 0;
+
+  memset(ata_device, 0, sizeof(ata_device));
+  memset(ata_active, 0, sizeof(ata_active));
+
+  /* Find a bus master capable IDE controller with
+   * both channels in compatibility mode */
+  ata_bmide = 0;
+  pdev = pci_find_class(0x01, 0x01);
+  if(pdev && (pdev->prog_if & 0x80) && !(pdev->prog_if & 0x05) &&
+    (pdev->bar4 & 0x01)) {
+    ata_bmide = (uint)pdev->bar4 & ~3;
+    pci_enable_bus_master(pdev);
+    debugstr("ata: bus master IDE at %x\n\r", ata_bmide);
+  }
+
+  /* Detect devices */
+  for(i=0; i<ATA_MAX_DEVICES; i++) {
+    ata_device[i].base = i < 2 ? 0x1F0 : 0x170;
+    ata_device[i].control = i < 2 ? 0x3F6 : 0x376;
+    ata_device[i].slave = i % 2;
+    if(ata_identify(&ata_device[i]) == 0) {
+      ata_device[i].present = 1;
+      if(ata_bmide == 0) {
+        ata_device[i].dma = 0;
+      }
+      debugstr("ata: device %d found (sectors=%U multiple=%d dma=%d)\n\r",
+        i + 1, ata_device[i].sectors, ata_device[i].multiple,
+        ata_device[i].dma);
+    }
+  }
+
+  /* Completion of DMA transfers is signaled with interrupts */
+  if(ata_bmide != 0) {
+    outb(0, 0x3F6 + ATA_CONTROL);
+    outb(0, 0x376 + ATA_CONTROL);
+    install_ata_IRQ_handlers();
+  }
+
+  /* BIOS numbers hard disks in the same order ATA devices are
+   * detected, so assign them in this order. A device must have
+   * at least the sectors reported by BIOS geometry */
+  for(i=0; i<MAX_DISK; i++) {
+    disk_info[i].ata = 0;
+    if(disk_info[i].id < 0x80 || disk_info[i].size == 0) {
+      continue;
+    }
+
+    while(dev < ATA_MAX_DEVICES && !ata_device[dev].present) {
+      dev++;
+    }
+    if(dev >= ATA_MAX_DEVICES) {
+      break;
+    }
+
+    bios_sectors = (ul_t)disk_info[i].sectors *
+      (ul_t)disk_info[i].sides * (ul_t)disk_info[i].cylinders;
+    if(bios_sectors <= ata_device[dev].sectors) {
+      disk_info[i].ata = dev + 1;
+      debugstr("ata: %s uses device %d\n\r", disk_info[i].name, dev + 1);
+    }
+    dev++;
+  }
+}
+
+/*
+ * Check params of a transfer
+ * Returns 0 if they are valid, ERROR_IO otherwise
+ */
+static uint ata_check(uint dev, ul_t sector, uint n)
+{
+  if(dev == 0 || dev > ATA_MAX_DEVICES || !ata_device[dev-1].present ||
+    n == 0 || n > 255 || sector + n > ata_device[dev-1].sectors) {
+    return ERROR_IO;
+  }
+  return 0;
+}
+
+/*
+ * Finish the request in progress of a channel
+ * If timeout is not 0, it failed, whatever the controller status is
+ */
+static void ata_complete(uint channel, uint timeout)
+{
+  ata_request_t* req = ata_active[channel];
+  uint bm = ata_bmide + channel*8;
+  uint bm_status = 0;
+  uint status = 0;
+
+  if(req == 0) {
+    return;
+  }
+
+  bm_status = inb(bm + BM_STATUS);
+  outb(0, bm + BM_COMMAND);
+  status = inb(ata_device[channel*2].base + ATA_STATUS); /* Ack device IRQ */
+  outb((uchar)(bm_status | BM_SR_ERR | BM_SR_IRQ), bm + BM_STATUS);
+
+  req->result = 0;
+  if(timeout) {
+    debugstr("ata: device %d DMA timeout (%x %x)\n\r", req->dev,
+      bm_status, status);
+    req->result = ERROR_IO;
+  } else if((bm_status & BM_SR_ERR) || (status & (ATA_SR_ERR | ATA_SR_DF))) {
+    debugstr("ata: device %d DMA error (%x %x)\n\r", req->dev,
+      bm_status, status);
+    req->result = ERROR_IO;
+  }
+
+  ata_active[channel] = 0;
+  req->pending = 0;
+  if(req->done != 0) {
+    status = req->result == 0 ? 1 : req->result;
+    lmem_copy(req->done, lp(&status), sizeof(status));
+  }
+}
+
+/*
+ * ATA IRQ handler
+ */
+void ata_handler(uint channel)
+{
+  if(ata_active[channel] != 0 &&
+    (inb(ata_bmide + channel*8 + BM_STATUS) & BM_SR_IRQ)) {
+    ata_complete(channel, 0);
+    return;
+  }
+
+  /* Not a DMA transfer: it's a BIOS or PIO one. Do what the
+   * BIOS handler does: ack the device IRQ and set the BIOS flag */
+  inb(ata_device[channel*2].base + ATA_STATUS);
+  lmem_setbyte(0x48EL, 0xFF);
+}
+
+/*
+ * Wait until request is finished
+ */
+uint ata_wait_request(ata_request_t* req)
+{
+  ul_t start = system_timer_ms;
+  uint channel = (req->dev - 1) / 2;
+
+  while(req->pending) {
+    /* The IRQ could be lost. Check the controller like the handler */
+    if(ata_active[channel] == req &&
+      (inb(ata_bmide + channel*8 + BM_STATUS) & BM_SR_IRQ)) {
+      ata_complete(channel, 0);
+    } else if(system_timer_ms - start >= ATA_TIMEOUT) {
+      /* The transfer hung: stop it and fail */
+      ata_complete(channel, 1);
+    }
+  }
+
+  return req->result;
+}
+
+/*
+ * Submit asynchronous request
+ */
+uint ata_submit(ata_request_t* req)
+{
+  struct ata_device* d = 0;
+  ul_t* prdt = 0;
+  lp_t prdt_addr = 0;
+  lp_t addr = 0;
+  ul_t size = 0;
+  ul_t c = 0;
+  uint channel = 0;
+  uint bm = 0;
+  uint i = 0;
+
+  if(ata_check(req->dev, req->sector, req->n) != 0) {
+    return ERROR_IO;
+  }
+  d = &ata_device[req->dev-1];
+  if(!d->dma || (req->buff & 1L)) {
+    return ERROR_NOT_FOUND;
+  }
+
+  channel = (req->dev - 1) / 2;
+  bm = ata_bmide + channel*8;
+
+  /* Wait for the previous request of this channel */
+  if(ata_active[channel] != 0) {
+    ata_wait_request(ata_active[channel]);
+  }
+
+  /* Build the PRDT */
+  prdt_addr = (lp(ata_prdt_buff[channel]) + 3L) & ~3L;
+  if((prdt_addr & 0xFFFFL) + ATA_PRDT_SIZE > 0x10000L) {
+    prdt_addr = (prdt_addr + 0xFFFFL) & ~0xFFFFL;
+  }
+  prdt = (ul_t*)&ata_prdt_buff[channel][prdt_addr - lp(ata_prdt_buff[channel])];
+
+  addr = req->buff;
+  size = (ul_t)req->n * SECTOR_SIZE;
+  while(size > 0) {
+    c = min(size, 0x10000L - (addr & 0xFFFFL));
+    prdt[i++] = addr;
+    prdt[i++] = c & 0xFFFFL; /* 0 means 64KB */
+    addr += c;
+    size -= c;
+  }
+  prdt[i-1] |= 0x80000000L; /* Last region */
+
+  /* Select device */
+  ata_select(d, (uint)(req->sector >> 24));
+  if(ata_wait(d) & ATA_SR_BSY) {
+    return ERROR_IO;
+  }
+
+  /* Prepare controller */
+  outl(prdt_addr, bm + BM_PRDT);
+  outb(req->write ? 0 : BM_CMD_READ, bm + BM_COMMAND);
+  outb(BM_SR_ERR | BM_SR_IRQ, bm + BM_STATUS);
+
+  req->pending = 1;
+  req->result = 0;
+  if(req->done != 0) {
+    lmem_copy(req->done, lp(&req->result), sizeof(req->result));
+  }
+  ata_active[channel] = req;
+
+  /* Send command and start */
+  outb((uchar)req->n, d->base + ATA_NSECT);
+  outb((uchar)req->sector, d->base + ATA_LBA0);
+  outb((uchar)(req->sector >> 8), d->base + ATA_LBA1);
+  outb((uchar)(req->sector >> 16), d->base + ATA_LBA2);
+  outb(req->write ? ATA_CMD_WRITE_DMA : ATA_CMD_READ_DMA,
+    d->base + ATA_COMMAND);
+  outb((req->write ? 0 : BM_CMD_READ) | BM_CMD_START, bm + BM_COMMAND);
+
+  return 0;
+}
+
+/*
+ * Transfer n sectors between device dev and buff (linear address)
+ * DMA is used if possible, otherwise PIO
+ * Returns 0 on success, ERROR_IO otherwise
+ */
+static uint ata_transfer(uint dev, ul_t sector, uint n, lp_t buff, uint write)
+{
+  ata_request_t req;
+  struct ata_device* d = 0;
+  uint result = 0;
+  uint c = 0;
+
+  /* Check params */
+  if(ata_check(dev, sector, n) != 0) {
+    return ERROR_IO;
+  }
+  d = &ata_device[dev-1];
+
+  /* DMA */
+  req.dev = dev;
+  req.sector = sector;
+  req.n = n;
+  req.buff = buff;
+  req.write = write;
+  req.done = 0;
+  result = ata_submit(&req);
+  if(result == 0) {
+    return ata_wait_request(&req);
+  }
+  if(result != ERROR_NOT_FOUND) {
+    return result;
+  }
+
+  /* PIO. Wait for DMA requests of this channel first */
+  if(ata_active[(dev-1)/2] != 0) {
+    ata_wait_request(ata_active[(dev-1)/2]);
+  }
+
+  /* Send command */
+  ata_select(d, (uint)(sector >> 24));
+  if(ata_wait(d) & ATA_SR_BSY) {
+    return ERROR_IO;
+  }
+
+  outb((uchar)n, d->base + ATA_NSECT);
+  outb((uchar)sector, d->base + ATA_LBA0);
+  outb((uchar)(sector >> 8), d->base + ATA_LBA1);
+  outb((uchar)(sector >> 16), d->base + ATA_LBA2);
+  if(d->multiple > 1) {
+    outb(write ? ATA_CMD_WRITE_MULTIPLE : ATA_CMD_READ_MULTIPLE,
+      d->base + ATA_COMMAND);
+  } else {
+    outb(write ? ATA_CMD_WRITE_SECTORS : ATA_CMD_READ_SECTORS,
+      d->base + ATA_COMMAND);
+  }
+
+  /* Transfer a block of sectors each time the device requests it */
+  while(n > 0) {
+    c = min(n, d->multiple);
+    if(ata_wait_drq(d) != 0) {
+      debugstr("ata: device %d error (%x)\n\r", dev,
+        inb(d->base + ATA_ERROR));
+      return ERROR_IO;
+    }
+
+    if(write) {
+      outsw_lmem(d->base + ATA_DATA, buff, c * (SECTOR_SIZE/2));
+    } else {
+      insw_lmem(d->base + ATA_DATA, buff, c * (SECTOR_SIZE/2));
+    }
+
+    buff += (lp_t)c * (lp_t)SECTOR_SIZE;
+    n -= c;
+  }
+
+  /* Writes are finished once the device is not busy */
+  if(write && (ata_wait(d) & (ATA_SR_BSY | ATA_SR_ERR | ATA_SR_DF))) {
+    return ERROR_IO;
+  }
+
+  return 0;
+}
+
+/*
+ * Read sectors
+ */
+uint ata_read(uint dev, ul_t sector, uint n, lp_t buff)
+{
+  return ata_transfer(dev, sector, n, buff, 0);
+}
+
+/*
+ * Write sectors
+ */
+uint ata_write(uint dev, ul_t sector, uint n, lp_t buff)
+{
+  return ata_transfer(dev, sector, n, buff, 1);
+}
@@ -0,0 +1,79 @@
+/*
+ * ATA disks
+ */
+
+#ifndef _ATA_H
+#define _ATA_H
+
+/* Native ATA driver for the primary and secondary IDE channels.
+ * Disks are accessed with LBA28 and PIO, transferring several
+ * sectors per interrupt (READ/WRITE MULTIPLE) when supported.
+ *
+ * ATA devices are numbered from 1 to ATA_MAX_DEVICES:
+ * 1: primary master    2: primary slave
+ * 3: secondary master  4: secondary slave
+ * disk_info[].ata contains the device number used to access a
+ * disk, or 0 if it must be accessed through BIOS
+ *
+ * If the IDE controller supports bus master DMA, transfers are done
+ * with DMA and their completion is signaled with IRQ14 (primary
+ * channel) or IRQ15 (secondary channel), so requests can be also
+ * submitted asynchronously
+ */
+#define ATA_MAX_DEVICES 4
+
+/* Asynchronous request */
+typedef struct {
+  uint  dev;     /* ATA device number */
+  ul_t  sector;  /* First sector */
+  uint  n;       /* Number of sectors */
+  lp_t  buff;    /* Linear address of buffer. Must be even */
+  uint  write;   /* 0 to read, 1 to write */
+  lp_t  done;    /* Linear address of a uint completion flag, or 0 */
+  uint  pending; /* 1 while in progress */
+  uint  result;  /* 0 on success, another value otherwise */
+} ata_request_t;
+
+/*
+ * Initialize ATA
+ * Detects devices and assigns them to BIOS hard disks
+ * Requires the system timer to be already initialized
+ */
+void ata_init();
+
+/*
+ * ATA IRQ handler
+ * channel is 0 for IRQ14, 1 for IRQ15
+ */
+void ata_handler(uint channel);
+
+/*
+ * Submit asynchronous request
+ * The request must not be modified until it's finished. Then
+ * pending becomes 0, result is set, and if done is provided, its
+ * value becomes 1 on success or an error code otherwise.
+ * Returns 0 if submitted, ERROR_NOT_FOUND if the device or the
+ * buffer does not allow asynchronous requests, or ERROR_IO
+ */
+uint ata_submit(ata_request_t* req);
+
+/*
+ * Wait until request is finished
+ * Returns its result
+ */
+uint ata_wait_request(ata_request_t* req);
+
+/*
+ * Read n sectors from device dev, starting at sector, to buff (linear address)
+ * Returns 0 on success, another value otherwise
+ */
+uint ata_read(uint dev, ul_t sector, uint n, lp_t buff);
+
+/*
+ * Write n sectors to device dev, starting at sector, from buff (linear address)
+ * Returns 0 on success, another value otherwise
+ */
+uint ata_write(uint dev, ul_t sector, uint n, lp_t buff);
+
+
+#endif   /* _ATA_H */
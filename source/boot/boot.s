@@ -70,7 +70,9 @@ start:
   cmp  ax, 1
   jne  .inc_loop        ; If it was the super block
   mov  bx, [BUFFER]
-  mov  ax, [es:bx+12]
+  mov  ax, [es:bx+32]   ; Block size
+  shr  ax, 9            ; Sectors per block
+  mul  word [es:bx+12]  ; First block of the bootable image
   mov  bx, ax
   add  bx, 127
   mov  [LASTBLOCK], bx
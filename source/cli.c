@@ -29,6 +29,9 @@ static void cli_cls(uint argc)
   }
 }
 
+/* Number of directory entries read at once by list and clone */
+#define CLI_DIR_BATCH 16
+
 /* List command: list directory entries */
 static void cli_list(uint argc, uchar* argv[])
 {
@@ -40,12 +43,12 @@ static void cli_list(uint argc, uchar* argv[])
   }
 
   if(argc == 2) {
-    uint n=0, i=0, result=0;
+    uint n=0, i=0, cookie=0;
     uchar line[64];
-    sfs_entry_t entry;
+    fs_entry_t entries[CLI_DIR_BATCH];
 
-    /* Get number of entries in target dir */
-    n = fs_list(&entry, argv[1], 0);
+    /* Get first entries in target dir */
+    n = fs_readdir(lp(entries), CLI_DIR_BATCH, argv[1], &cookie);
     if(n >= ERROR_ANY) {
       putstr("path not found\n\r");
       return;
@@ -54,47 +57,50 @@ static void cli_list(uint argc, uchar* argv[])
     if(n > 0) {
       putstr("\n\r");
 
-      /* Print one by one */
-      for(i=0; i<n; i++) {
-        time_t etime;
-        uint c=0, size=0;
+      /* Print them a batch at a time */
+      while(n > 0) {
+        for(i=0; i<n; i++) {
+          time_t etime;
+          uint c=0, size=0;
+          fs_entry_t* entry = &entries[i];
+
+          /* Listed entry is a dir? If so,
+           * start this line with a '+' */
+          memset(line, 0, sizeof(line));
+          strcpy_s(line, entry->flags & FST_DIR ? "+ " : "  ", sizeof(line));
+          strcat_s(line, entry->name, sizeof(line)); /* Append name */
+
+          /* We want size to be right-aligned so add spaces
+           * depending on figures of entry size */
+          for(c=strlen(line); c<22; c++) {
+            line[c] = ' ';
+          }
+          size = entry->size;
+          while(size = size / 10 ) {
+            line[--c] = 0;
+          }
 
-        /* Get entry */
-        result = fs_list(&entry, argv[1], i);
-        if(result >= ERROR_ANY) {
-          putstr("Error\n\r");
-          break;
+          /* Print name and size */
+          putstr("%s%u %s   ", line, entry->size,
+            (entry->flags & FST_DIR) ? "items" : "bytes");
+
+          /* Print date */
+          fs_fstime_to_systime(entry->time, &etime);
+          putstr("%d/%s%d/%s%d %s%d:%s%d:%s%d\n\r",
+            etime.year,
+            etime.month <10?"0":"", etime.month,
+            etime.day   <10?"0":"", etime.day,
+            etime.hour  <10?"0":"", etime.hour,
+            etime.minute<10?"0":"", etime.minute,
+            etime.second<10?"0":"", etime.second);
         }
 
-        /* Listed entry is a dir? If so,
-         * start this line with a '+' */
-        memset(line, 0, sizeof(line));
-        strcpy_s(line, entry.flags & T_DIR ? "+ " : "  ", sizeof(line));
-        strcat_s(line, entry.name, sizeof(line)); /* Append name */
-
-        /* We want size to be right-aligned so add spaces
-         * depending on figures of entry size */
-        for(c=strlen(line); c<22; c++) {
-          line[c] = ' ';
-        }
-        size = entry.size;
-        while(size = size / 10 ) {
-          line[--c] = 0;
+        /* Get next entries */
+        n = fs_readdir(lp(entries), CLI_DIR_BATCH, argv[1], &cookie);
+        if(n >= ERROR_ANY) {
+          putstr("Error\n\r");
+          break;
         }
-
-        /* Print name and size */
-        putstr("%s%u %s   ", line, (uint)entry.size,
-          (entry.flags & T_DIR) ? "items" : "bytes");
-
-        /* Print date */
-        fs_fstime_to_systime(entry.time, &etime);
-        putstr("%d/%s%d/%s%d %s%d:%s%d:%s%d\n\r",
-          etime.year,
-          etime.month <10?"0":"", etime.month,
-          etime.day   <10?"0":"", etime.day,
-          etime.hour  <10?"0":"", etime.hour,
-          etime.minute<10?"0":"", etime.minute,
-          etime.second<10?"0":"", etime.second);
       }
       putstr("\n\r");
     }
@@ -189,12 +195,14 @@ static void cli_info(uint argc)
       n = index_to_disk(i);
       if(disk_info[i].size) {
         putstr("%s %s(%UMB)   Disk size: %UMB\n\r",
-          disk_to_string(n), disk_info[i].fstype == FS_TYPE_NSFS ? "NSFS" : "UNKN",
+          disk_to_string(n), disk_info[i].fstype == FS_TYPE_NSFS ? "NSFS" :
+          disk_info[i].fstype == FS_TYPE_NSFS_RO ? "NSRO" : "UNKN",
           (ul_t)blocks_to_MB(disk_info[i].fssize), disk_info[i].size);
       }
     }
     putstr("\n\r");
     putstr("System disk: %s\n\r", disk_to_string(system_disk));
+    putstr("Disk cache: %U hits, %U misses\n\r", fs_cache_hits, fs_cache_misses);
     putstr("Serial port status: %s\n\r", serial_status & 0x80 ? "Error" : "Enabled");
     putstr("A20 Line status: %s\n\r", a20_enabled ? "Enabled" : "Disabled");
     putstr("Network status: %s\n\r", network_enabled ? "Enabled" : "Disabled");
@@ -210,15 +218,16 @@ static void cli_info(uint argc)
 static void cli_clone(uint argc, uchar* argv[])
 {
   if(argc == 2) {
-    uint i=0, n=0, result=0;
-    sfs_entry_t entry;
+    uint i=0, n=0, result=0, cookie=0;
+    fs_entry_t entries[CLI_DIR_BATCH];
     uint disk=0, disk_index=0;
     uint sysdisk_index = disk_to_index(system_disk);
 
     /* Show source disk info */
     putstr("System disk: %s    fs=%s  size=%UMB\n\r",
       disk_to_string(system_disk),
-      disk_info[sysdisk_index].fstype == FS_TYPE_NSFS ? "NSFS   " : "unknown",
+      disk_info[sysdisk_index].fstype == FS_TYPE_NSFS ? "NSFS   " :
+      disk_info[sysdisk_index].fstype == FS_TYPE_NSFS_RO ? "NSFS-RO" : "unknown",
       blocks_to_MB(disk_info[sysdisk_index].fssize));
 
     /* Check target disk */
@@ -236,7 +245,8 @@ static void cli_clone(uint argc, uchar* argv[])
     disk_index = disk_to_index(disk);
     putstr("Target disk: %s    fs=%s  size=%UMB\n\r",
       disk_to_string(disk),
-      disk_info[disk_index].fstype == FS_TYPE_NSFS ? "NSFS   " : "unknown",
+      disk_info[disk_index].fstype == FS_TYPE_NSFS ? "NSFS   " :
+      disk_info[disk_index].fstype == FS_TYPE_NSFS_RO ? "NSFS-RO" : "unknown",
       blocks_to_MB(disk_info[disk_index].fssize));
 
     putstr("\n\r");
@@ -267,31 +277,39 @@ static void cli_clone(uint argc, uchar* argv[])
     /* Copy user files */
     putstr("Copying user files...\n\r");
 
-    n = fs_list(&entry, ROOT_DIR_NAME, 0);
+    n = fs_readdir(lp(entries), CLI_DIR_BATCH, ROOT_DIR_NAME, &cookie);
     if(n >= ERROR_ANY) {
       putstr("Error creating file list\n\r");
       return;
     }
 
-    /* List entries */
-    for(i=0; i<n; i++) {
-      uchar dst[MAX_PATH];
-      result = fs_list(&entry, ROOT_DIR_NAME, i);
-      if(result >= ERROR_ANY) {
-        putstr("Error copying files. Aborted\n\r");
+    /* Copy entries a batch at a time */
+    while(n > 0) {
+      for(i=0; i<n; i++) {
+        uchar dst[MAX_PATH];
+
+        strcpy_s(dst, argv[1], sizeof(dst));
+        strcat_s(dst, PATH_SEPARATOR_S, sizeof(dst));
+        strcat_s(dst, entries[i].name, sizeof(dst));
+
+        debugstr("copy %s %s\n\r", entries[i].name, dst);
+        result = fs_copy(entries[i].name, dst);
+        /* Skip ERROR_EXISTS errors, because system files were copied
+          * by fs_format function, so they are expected to fail */
+        if(result >= ERROR_ANY && result != ERROR_EXISTS) {
+          putstr("Error copying %s. Aborted\n\r", entries[i].name);
+          break;
+        }
+      }
+      if(i < n) {
         break;
       }
 
-      strcpy_s(dst, argv[1], sizeof(dst));
-      strcat_s(dst, PATH_SEPARATOR_S, sizeof(dst));
-      strcat_s(dst, entry.name, sizeof(dst));
-
-      debugstr("copy %s %s\n\r", entry.name, dst);
-      result = fs_copy(entry.name, dst);
-      /* Skip ERROR_EXISTS errors, because system files were copied
-        * by fs_format function, so they are expected to fail */
-      if(result >= ERROR_ANY && result != ERROR_EXISTS) {
-        putstr("Error copying %s. Aborted\n\r", entry.name);
+      /* Get next entries */
+      n = fs_readdir(lp(entries), CLI_DIR_BATCH, ROOT_DIR_NAME, &cookie);
+      if(n >= ERROR_ANY) {
+        putstr("Error copying files. Aborted\n\r");
+        result = n;
         break;
       }
     }
@@ -310,11 +328,16 @@ static void cli_read(uint argc, uchar* argv[])
 {
   if(argc==2 || (argc==3 && strcmp(argv[1],"hex")==0)) {
     uint result=0, i=0;
-    uint offset = 0;
+    uint handle = 0;
     uchar buff[512];
     memset(buff, 0, sizeof(buff));
+    handle = fs_open(argv[argc-1], 0);
+    if(handle >= ERROR_ANY) {
+      putstr("There was an error reading input file\n\r");
+      return;
+    }
     /* While it can read the file, print it */
-    while(result = fs_read_file(buff, argv[argc-1], offset, sizeof(buff))) {
+    while(result = fs_read(handle, lp(buff), sizeof(buff))) {
       if(result >= ERROR_ANY) {
         putstr("\n\rThere was an error reading input file\n\r");
         break;
@@ -331,8 +354,8 @@ static void cli_read(uint argc, uchar* argv[])
         }
       }
       memset(buff, 0, sizeof(buff));
-      offset += result;
     }
+    fs_close(handle);
     putstr("\n\r");
   } else {
     putstr("usage: read [hex] <path>\n\r");
@@ -361,6 +384,9 @@ static void cli_time(uint argc)
 /* Shutdown command: Shutdown computer */
 static void cli_shutdown(uint argc, uchar* argv[])
 {
+  /* Write delayed disk changes */
+  fs_cache_flush();
+
   if(argc == 1) {
     apm_shutdown();
 
@@ -386,6 +412,7 @@ static void cli_config(uint argc, uchar* argv[])
     putstr("graphics: %s    - use graphics mode\n\r", graphics_mode ? " enabled" : "disabled");
     putstr("net_IP: %u.%u.%u.%u\n\r", local_ip[0], local_ip[1], local_ip[2], local_ip[3]);
     putstr("net_gate: %u.%u.%u.%u\n\r", local_gate[0], local_gate[1], local_gate[2], local_gate[3]);
+    putstr("readahead: %u        - sectors read in advance (0-%u)\n\r", fs_readahead, READAHEAD_NSECTORS);
     putstr("\n\r");
   } else if(argc == 2 && strcmp(argv[1], "save") == 0) {
     uchar config_file[512];
@@ -409,7 +436,12 @@ static void cli_config(uint argc, uchar* argv[])
     strcat_s(config_file, ip_to_str(tmps, local_gate), sizeof(config_file));
     strcat_s(config_file, "\n", sizeof(config_file));
 
-    fs_write_file(config_file, "config.ini", 0, strlen(config_file)+1, WF_CREATE|WF_TRUNCATE);
+    strcat_s(config_file, "config readahead ", sizeof(config_file));
+    formatstr(tmps, sizeof(tmps), "%u", fs_readahead);
+    strcat_s(config_file, tmps, sizeof(config_file));
+    strcat_s(config_file, "\n", sizeof(config_file));
+
+    fs_write_file(lp(config_file), "config.ini", 0, strlen(config_file)+1, WF_CREATE|WF_TRUNCATE);
     debugstr("Config file saved\n\r");
 
   } else if(argc == 3) {
@@ -435,6 +467,12 @@ static void cli_config(uint argc, uchar* argv[])
       str_to_ip(local_ip, argv[2]);
     } else if(strcmp(argv[1], "net_gate") == 0) {
       str_to_ip(local_gate, argv[2]);
+    } else if(strcmp(argv[1], "readahead") == 0) {
+      if(stou(argv[2]) <= READAHEAD_NSECTORS) {
+        fs_readahead = stou(argv[2]);
+      } else {
+        putstr("Invalid value. Valid values are: 0 to %u\n\r", READAHEAD_NSECTORS);
+      }
     }
 
   } else {
@@ -463,23 +501,23 @@ static void cli_extern(uint argc, uchar* argv[])
     /* Found */
     if(entry.flags & T_FILE) {
       uint offset = 0;
+      uint handle = 0;
       /* It's a file: load it */
       uint mem_size = min((uint)entry.size, UPROG_ARGLOC-UPROG_MEMLOC);
       if(mem_size < (uint)entry.size) {
         putstr("not enough memory\n\r");
         return;
       }
+      handle = fs_open(prog_file_name, 0);
+      if(handle >= ERROR_ANY) {
+        putstr("error loading file\n\r");
+        return;
+      }
+      /* Read it directly in the program segment */
       while(offset < mem_size) {
-        uint r = 0;
-        uint count = 0;
-        uchar buff[512];
-        count = min(mem_size-offset, sizeof(buff));
-        r = fs_read_file(buff, prog_file_name, offset, count);
-        if(r<ERROR_ANY) {
-          uint b = 0;
-          for(b=0; b<r; b++) {
-            lmem_setbyte((lp_t)(UPROG_MEMSEG<<4)+UPROG_MEMLOC+(lp_t)(offset+b), buff[b]);
-          }
+        uint r = fs_read(handle,
+          (lp_t)(UPROG_MEMSEG<<4)+UPROG_MEMLOC+(lp_t)offset, mem_size-offset);
+        if(r<ERROR_ANY && r>0) {
           offset += r;
         } else  {
           putstr("error loading file\n\r");
@@ -488,6 +526,7 @@ static void cli_extern(uint argc, uchar* argv[])
           break;
         }
       }
+      fs_close(handle);
     } else {
       /* It's not a file: error */
       result = ERROR_NOT_FOUND;
@@ -523,6 +562,9 @@ static void cli_extern(uint argc, uchar* argv[])
 
     /* Run program */
     uprog_call(argc, UPROG_ARGLOC);
+
+    /* Close files the program left open */
+    fs_close_all();
   }
 }
 
@@ -635,7 +677,10 @@ static void execute(uchar* str)
     /* Not a built-in command */
     /* Try to find an executable file */
     cli_extern(argc, argv);
-  } 
+  }
+
+  /* Write delayed disk changes */
+  fs_cache_flush();
 }
 
 /*
@@ -650,7 +695,7 @@ void cli_exec_file(uchar* path)
 
   while(1) {
     /* Read file */
-    readed = fs_read_file(line, path, offset, sizeof(line));
+    readed = fs_read_file(lp(line), path, offset, sizeof(line));
     if(readed==0 || readed>=ERROR_ANY) {
       return;
     }
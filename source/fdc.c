@@ -0,0 +1,449 @@
+/*
+ * Floppy disk controller
+ */
+
+#include "types.h"
+#include "kernel.h"
+#include "hw86.h"
+#include "ulib/ulib.h"
+#include "fdc.h"
+
+/* Registers */
+#define FDC_DOR  0x3F2 /* Digital output register */
+#define FDC_MSR  0x3F4 /* Main status register */
+#define FDC_FIFO 0x3F5 /* Data FIFO */
+#define FDC_DIR  0x3F7 /* Digital input register (read) */
+#define FDC_CCR  0x3F7 /* Configuration control register (write) */
+
+#define FDC_DOR_ENABLE 0x0C /* Controller, IRQ and DMA enabled */
+#define FDC_MSR_RQM    0x80 /* Ready for data transfer */
+#define FDC_MSR_DIO    0x40 /* Data from controller to CPU */
+#define FDC_DIR_CHANGE 0x80 /* Disk changed */
+
+/* Commands */
+#define FDC_CMD_SPECIFY     0x03
+#define FDC_CMD_WRITE       0xC5 /* Write data, multitrack, MFM */
+#define FDC_CMD_READ        0xE6 /* Read data, multitrack, MFM, skip deleted */
+#define FDC_CMD_RECALIBRATE 0x07
+#define FDC_CMD_SENSE_INT   0x08
+#define FDC_CMD_SEEK        0x0F
+#define FDC_CMD_VERSION     0x10
+
+/* ISA DMA controller registers for channel 2 */
+#define DMA_ADDR  0x04
+#define DMA_COUNT 0x05
+#define DMA_MASK  0x0A
+#define DMA_MODE  0x0B
+#define DMA_FLIP  0x0C
+#define DMA_PAGE  0x81
+
+#define DMA_MODE_READ  0x46 /* Single transfer, device to memory */
+#define DMA_MODE_WRITE 0x4A /* Single transfer, memory to device */
+
+#define FDC_TIMEOUT 2000 /* Max time waiting for controller (ms) */
+#define FDC_SPINUP  500  /* Motor spin up time (ms) */
+#define FDC_RETRIES 3
+
+static uint fdc_enabled = 0; /* 1 if controller was found */
+static uint fdc_reset_needed = 1;
+static uint fdc_dor = 0;     /* Current digital output register */
+static uint fdc_irq = 0;     /* Set by IRQ handler */
+static uint fdc_cyl[2];      /* Current cylinder of each drive */
+
+/* Cylinder in track buffer. track_disk is UNKNOWN_VALUE if none */
+static uint track_disk = UNKNOWN_VALUE;
+static uint track_cyl = 0;
+
+extern void install_fdc_IRQ_handler();
+
+/*
+ * Send a byte to the controller
+ * Returns 0 on success, ERROR_IO on timeout
+ */
+static uint fdc_send(uint b)
+{
+  ul_t start = system_timer_ms;
+  while((inb(FDC_MSR) & (FDC_MSR_RQM | FDC_MSR_DIO)) != FDC_MSR_RQM) {
+    if(system_timer_ms - start > FDC_TIMEOUT) {
+      return ERROR_IO;
+    }
+  }
+  outb((uchar)b, FDC_FIFO);
+  return 0;
+}
+
+/*
+ * Get a result byte from the controller
+ * Returns the byte, or ERROR_IO on timeout
+ */
+static uint fdc_result()
+{
+  ul_t start = system_timer_ms;
+  while((inb(FDC_MSR) & (FDC_MSR_RQM | FDC_MSR_DIO)) !=
+    (FDC_MSR_RQM | FDC_MSR_DIO)) {
+    if(system_timer_ms - start > FDC_TIMEOUT) {
+      return ERROR_IO;
+    }
+  }
+  return inb(FDC_FIFO);
+}
+
+/*
+ * Wait until the controller raises an IRQ
+ * Returns 0 on success, ERROR_IO on timeout
+ */
+static uint fdc_wait_irq()
+{
+  ul_t start = system_timer_ms;
+  while(!fdc_irq) {
+    if(system_timer_ms - start > FDC_TIMEOUT) {
+      return ERROR_IO;
+    }
+  }
+  fdc_irq = 0;
+  return 0;
+}
+
+/*
+ * Sense interrupt status
+ * Output: cyl, present cylinder number
+ * Returns status register 0, or ERROR_IO
+ */
+static uint fdc_sense_interrupt(uint* cyl)
+{
+  uint st0 = 0;
+  if(fdc_send(FDC_CMD_SENSE_INT) != 0) {
+    return ERROR_IO;
+  }
+  st0 = fdc_result();
+  *cyl = fdc_result();
+  return st0;
+}
+
+/*
+ * Reset controller
+ * Returns 0 on success, ERROR_IO otherwise
+ */
+static uint fdc_reset()
+{
+  uint cyl = 0;
+  uint i = 0;
+
+  fdc_irq = 0;
+  outb(0, FDC_DOR);
+  outb(FDC_DOR_ENABLE, FDC_DOR);
+  fdc_dor = FDC_DOR_ENABLE;
+  if(fdc_wait_irq() != 0) {
+    return ERROR_IO;
+  }
+
+  /* One sense interrupt for each drive */
+  for(i=0; i<4; i++) {
+    fdc_sense_interrupt(&cyl);
+  }
+
+  /* 500 kbps, for 1.44MB disks */
+  outb(0, FDC_CCR);
+
+  /* Step rate 3ms, head unload 240ms, head load 16ms, DMA mode */
+  if(fdc_send(FDC_CMD_SPECIFY) != 0 || fdc_send(0xDF) != 0 ||
+    fdc_send(0x02) != 0) {
+    return ERROR_IO;
+  }
+
+  /* Head positions are unknown now */
+  fdc_cyl[0] = UNKNOWN_VALUE;
+  fdc_cyl[1] = UNKNOWN_VALUE;
+  fdc_reset_needed = 0;
+  return 0;
+}
+
+/*
+ * Select drive and turn on its motor
+ */
+static void fdc_motor_on(uint drive)
+{
+  ul_t start = 0;
+  uint dor = FDC_DOR_ENABLE | drive | (0x10 << drive);
+
+  disk_info[drive].last_access = system_timer_ms;
+  if(fdc_dor == dor) {
+    return;
+  }
+
+  outb((uchar)dor, FDC_DOR);
+  if(!(fdc_dor & (0x10 << drive))) {
+    start = system_timer_ms;
+    while(system_timer_ms - start < FDC_SPINUP) {
+    }
+  }
+  fdc_dor = dor;
+
+  /* Discard track buffer if disk was replaced */
+  if((inb(FDC_DIR) & FDC_DIR_CHANGE) && track_disk == drive) {
+    track_disk = UNKNOWN_VALUE;
+  }
+}
+
+/*
+ * Move drive head to a cylinder
+ * Returns 0 on success, ERROR_IO otherwise
+ */
+static uint fdc_seek(uint drive, uint cyl)
+{
+  uint st0 = 0;
+  uint pcn = 0;
+
+  if(fdc_cyl[drive] == cyl) {
+    return 0;
+  }
+
+  /* After a reset or an error, recalibrate first */
+  if(fdc_cyl[drive] == UNKNOWN_VALUE) {
+    fdc_irq = 0;
+    if(fdc_send(FDC_CMD_RECALIBRATE) != 0 || fdc_send(drive) != 0 ||
+      fdc_wait_irq() != 0) {
+      return ERROR_IO;
+    }
+    st0 = fdc_sense_interrupt(&pcn);
+    if(st0 >= ERROR_ANY || (st0 & 0xC0) || pcn != 0) {
+      return ERROR_IO;
+    }
+    fdc_cyl[drive] = 0;
+  }
+
+  fdc_irq = 0;
+  if(fdc_send(FDC_CMD_SEEK) != 0 || fdc_send(drive) != 0 ||
+    fdc_send(cyl) != 0 || fdc_wait_irq() != 0) {
+    fdc_cyl[drive] = UNKNOWN_VALUE;
+    return ERROR_IO;
+  }
+  st0 = fdc_sense_interrupt(&pcn);
+  if(st0 >= ERROR_ANY || (st0 & 0xC0) || pcn != cyl) {
+    fdc_cyl[drive] = UNKNOWN_VALUE;
+    return ERROR_IO;
+  }
+
+  fdc_cyl[drive] = cyl;
+  return 0;
+}
+
+/*
+ * Prepare DMA channel 2 to transfer size bytes from or to addr
+ * addr must be below 16MB and must not cross a 64KB bound
+ */
+static void fdc_dma(lp_t addr, uint size, uint write)
+{
+  outb(0x06, DMA_MASK); /* Mask channel 2 */
+  outb(0xFF, DMA_FLIP); /* Reset flip-flop */
+  outb((uchar)addr, DMA_ADDR);
+  outb((uchar)(addr >> 8), DMA_ADDR);
+  outb((uchar)(addr >> 16), DMA_PAGE);
+  outb(0xFF, DMA_FLIP);
+  outb((uchar)(size - 1), DMA_COUNT);
+  outb((uchar)((size - 1) >> 8), DMA_COUNT);
+  outb(write ? DMA_MODE_WRITE : DMA_MODE_READ, DMA_MODE);
+  outb(0x02, DMA_MASK); /* Unmask channel 2 */
+}
+
+/*
+ * Read or write n sectors of a cylinder, from or to addr (linear address)
+ * The first one is sector of head (sectors start at 1). Multitrack mode
+ * is used, so transfers continue in head 1 after the last sector of head 0
+ * Returns 0 on success, ERROR_IO otherwise
+ */
+static uint fdc_rw(uint drive, uint cyl, uint head, uint sector, uint n,
+  lp_t addr, uint write)
+{
+  uint st[7];
+  uint i = 0;
+  uint retry = 0;
+
+  for(retry=0; retry<FDC_RETRIES; retry++) {
+    if(fdc_reset_needed && fdc_reset() != 0) {
+      continue;
+    }
+
+    fdc_motor_on(drive);
+    if(fdc_seek(drive, cyl) != 0) {
+      fdc_reset_needed = 1;
+      continue;
+    }
+
+    fdc_dma(addr, n*SECTOR_SIZE, write);
+    fdc_irq = 0;
+    if(fdc_send(write ? FDC_CMD_WRITE : FDC_CMD_READ) != 0 ||
+      fdc_send((head << 2) | drive) != 0 || fdc_send(cyl) != 0 ||
+      fdc_send(head) != 0 || fdc_send(sector) != 0 ||
+      fdc_send(2) != 0 || /* 512 bytes per sector */
+      fdc_send(disk_info[drive].sectors) != 0 || /* Last sector */
+      fdc_send(0x1B) != 0 || fdc_send(0xFF) != 0 ||
+      fdc_wait_irq() != 0) {
+      fdc_reset_needed = 1;
+      continue;
+    }
+
+    for(i=0; i<7; i++) {
+      st[i] = fdc_result();
+    }
+    if(st[0] < ERROR_ANY && !(st[0] & 0xC0)) {
+      return 0;
+    }
+
+    /* Recalibrate and try again */
+    debugstr("fdc: error (%x %x %x)\n\r", st[0], st[1], st[2]);
+    fdc_cyl[drive] = UNKNOWN_VALUE;
+  }
+
+  return ERROR_IO;
+}
+
+/*
+ * Check floppy disk can be accessed with this driver
+ */
+static uint fdc_check(uint disk, ul_t sector, uint n)
+{
+  if(disk >= 2 || disk_info[disk].fdc == 0 ||
+    sector + n > (ul_t)disk_info[disk].sectors *
+    (ul_t)disk_info[disk].sides * (ul_t)disk_info[disk].cylinders) {
+    return ERROR_IO;
+  }
+  return 0;
+}
+
+/*
+ * Initialize floppy disk controller
+ */
+void fdc_init()
+{
+  uint i = 0;
+
+  disk_info[0].fdc = 0;
+  disk_info[1].fdc = 0;
+  track_disk = UNKNOWN_VALUE;
+
+  /* The IRQ handler also does what the BIOS one did,
+   * so BIOS can still be used for floppy disks */
+  install_fdc_IRQ_handler();
+  if(fdc_reset() != 0 || fdc_send(FDC_CMD_VERSION) != 0 ||
+    fdc_result() >= ERROR_ANY) {
+    debugstr("fdc: controller not found\n\r");
+    return;
+  }
+  fdc_enabled = 1;
+
+  /* Only 1.44MB disks are supported */
+  for(i=0; i<2; i++) {
+    if(disk_info[i].sectors == 18 && disk_info[i].sides == 2 &&
+      disk_info[i].cylinders == 80) {
+      disk_info[i].fdc = 1;
+      debugstr("fdc: %s uses native driver\n\r", disk_info[i].name);
+    }
+  }
+}
+
+/*
+ * Floppy disk controller IRQ handler
+ */
+void fdc_handler()
+{
+  fdc_irq = 1;
+  lmem_setbyte(0x43EL, lmem_getbyte(0x43EL) | 0x80); /* BIOS flag */
+}
+
+/*
+ * Turn off floppy disk motors
+ */
+void fdc_motors_off()
+{
+  if(!fdc_enabled) {
+    turn_off_fd_motors();
+    return;
+  }
+  outb(FDC_DOR_ENABLE, FDC_DOR);
+  fdc_dor = FDC_DOR_ENABLE;
+  track_disk = UNKNOWN_VALUE;
+}
+
+/*
+ * Read sectors
+ */
+uint fdc_read(uint disk, ul_t sector, uint n, lp_t buff)
+{
+  uint spc = 0;
+  uint cyl = 0;
+  uint first = 0;
+  uint c = 0;
+
+  if(fdc_check(disk, sector, n) != 0) {
+    return ERROR_IO;
+  }
+  spc = disk_info[disk].sectors * disk_info[disk].sides;
+
+  while(n > 0) {
+    cyl = (uint)(sector / spc);
+    first = (uint)(sector % spc);
+    c = min(n, spc - first);
+
+    /* Read the whole cylinder in track buffer if needed */
+    if(track_disk != disk || track_cyl != cyl) {
+      track_disk = UNKNOWN_VALUE;
+      if(fdc_rw(disk, cyl, 0, 1, spc, FDC_TRACK_ADDR, 0) != 0) {
+        return ERROR_IO;
+      }
+      track_disk = disk;
+      track_cyl = cyl;
+    }
+
+    lmem_copy(buff, FDC_TRACK_ADDR + (lp_t)first*SECTOR_SIZE, c*SECTOR_SIZE);
+
+    sector += c;
+    buff += (lp_t)c*SECTOR_SIZE;
+    n -= c;
+  }
+
+  return 0;
+}
+
+/*
+ * Write sectors
+ */
+uint fdc_write(uint disk, ul_t sector, uint n, lp_t buff)
+{
+  uint spc = 0;
+  uint cyl = 0;
+  uint first = 0;
+  uint c = 0;
+  lp_t addr = 0;
+
+  if(fdc_check(disk, sector, n) != 0) {
+    return ERROR_IO;
+  }
+  spc = disk_info[disk].sectors * disk_info[disk].sides;
+
+  while(n > 0) {
+    cyl = (uint)(sector / spc);
+    first = (uint)(sector % spc);
+    c = min(n, spc - first);
+
+    /* Write from the track buffer, so it remains valid
+     * if it contains this cylinder */
+    if(track_disk != disk || track_cyl != cyl) {
+      track_disk = UNKNOWN_VALUE;
+    }
+    addr = FDC_TRACK_ADDR + (lp_t)first*SECTOR_SIZE;
+    lmem_copy(addr, buff, c*SECTOR_SIZE);
+
+    if(fdc_rw(disk, cyl, first / disk_info[disk].sectors,
+      first % disk_info[disk].sectors + 1, c, addr, 1) != 0) {
+      track_disk = UNKNOWN_VALUE;
+      return ERROR_IO;
+    }
+
+    sector += c;
+    buff += (lp_t)c*SECTOR_SIZE;
+    n -= c;
+  }
+
+  return 0;
+}
@@ -0,0 +1,50 @@
+/*
+ * Floppy disk controller
+ */
+
+#ifndef _FDC_H
+#define _FDC_H
+
+/* Native driver for 82077 compatible floppy disk controllers,
+ * using ISA DMA channel 2. Only 1.44MB disks are supported.
+ *
+ * Reads are done a cylinder at a time (both heads) into a track
+ * buffer in far memory (see kernel.h), and following reads of the
+ * same cylinder are served from this buffer. Writes go to disk
+ * at once, and also update the track buffer.
+ *
+ * disk_info[].fdc is 1 when a disk is accessed with this driver,
+ * and 0 if it must be accessed through BIOS
+ */
+
+/*
+ * Initialize floppy disk controller
+ * Requires the system timer to be already initialized
+ */
+void fdc_init();
+
+/*
+ * Floppy disk controller IRQ handler
+ */
+void fdc_handler();
+
+/*
+ * Turn off floppy disk motors
+ * Disks can be replaced then, so the track buffer is discarded
+ */
+void fdc_motors_off();
+
+/*
+ * Read n sectors of floppy disk, starting at sector, to buff (linear address)
+ * Returns 0 on success, another value otherwise
+ */
+uint fdc_read(uint disk, ul_t sector, uint n, lp_t buff);
+
+/*
+ * Write n sectors to floppy disk, starting at sector, from buff (linear address)
+ * Returns 0 on success, another value otherwise
+ */
+uint fdc_write(uint disk, ul_t sector, uint n, lp_t buff);
+
+
+#endif   /* _FDC_H */
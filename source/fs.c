@@ -6,6 +6,8 @@
 #include "kernel.h"
 #include "fs.h"
 #include "hw86.h"
+#include "ata.h"
+#include "fdc.h"
 #include "ulib/ulib.h"
 
 /*
@@ -86,7 +88,7 @@ uint string_is_disk(uchar* str)
 }
 
 /*
- * Convert number of blocks to size in MB
+ * Convert number of BLOCK_SIZE blocks to size in MB
  */
 uint32_t blocks_to_MB(uint32_t blocks)
 {
@@ -119,17 +121,639 @@ static uchar* string_to_name(uchar* str)
   return str;
 }
 
+/*
+ * Get the directory reference to entry n, given its name
+ * The name hash is stored in the high 16 bits. See fs.h
+ */
+static ul_t dir_ref(uint n, uchar* name)
+{
+  uint hash = 0;
+  while(*name) {
+    hash = (hash*31 + *name++) & 0xFFFF;
+  }
+  return ((ul_t)hash << 16) | n;
+}
+
+/*
+ * Lookup cache
+ *
+ * Results of recent name lookups in fs_get_entry are kept here:
+ * (disk, parent, name) is mapped to the found entry index, or to
+ * ERROR_NOT_FOUND if the name does not exist.
+ * Operations which create, delete, move or rename entries must drop
+ * the affected ones.
+ */
+#define DENTRY_NCACHED 16
+
+static struct dentry_info {
+  uint  disk;
+  uint  parent;
+  uint  n;    /* Entry index or ERROR_NOT_FOUND */
+  uchar name[SFS_NAMESIZE];  /* Empty if unused */
+  ul_t  last_use;
+} dentry[DENTRY_NCACHED];
+
+static ul_t dentry_clock = 0; /* Incremented on each cache access */
+
+/*
+ * Find a lookup result in cache
+ * Returns 1 if found and sets n, 0 otherwise
+ */
+static uint dentry_find(uint disk, uint parent, uchar* name, uint* n)
+{
+  uint i = 0;
+  for(i=0; i<DENTRY_NCACHED; i++) {
+    if(dentry[i].name[0] && dentry[i].disk == disk &&
+      dentry[i].parent == parent && !strcmp(dentry[i].name, name)) {
+      dentry[i].last_use = ++dentry_clock;
+      *n = dentry[i].n;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Add a lookup result to cache, replacing the least recently used one
+ */
+static void dentry_add(uint disk, uint parent, uchar* name, uint n)
+{
+  uint i = 0;
+  uint j = 0;
+
+  /* Names which do not fit can't be cached */
+  if(strlen(name) >= SFS_NAMESIZE || name[0] == 0) {
+    return;
+  }
+
+  for(i=0; i<DENTRY_NCACHED; i++) {
+    if(dentry[i].name[0] == 0) {
+      j = i;
+      break;
+    }
+    if(dentry[i].last_use < dentry[j].last_use) {
+      j = i;
+    }
+  }
+
+  dentry[j].disk = disk;
+  dentry[j].parent = parent;
+  dentry[j].n = n;
+  strcpy_s(dentry[j].name, name, SFS_NAMESIZE);
+  dentry[j].last_use = ++dentry_clock;
+}
+
+/*
+ * Drop cached lookups of a name in a directory
+ */
+static void dentry_drop_name(uint disk, uint parent, uchar* name)
+{
+  uint i = 0;
+  for(i=0; i<DENTRY_NCACHED; i++) {
+    if(dentry[i].disk == disk && dentry[i].parent == parent &&
+      !strcmp(dentry[i].name, name)) {
+      dentry[i].name[0] = 0;
+    }
+  }
+}
+
+/*
+ * Drop cached lookups which found entry n or were done inside it
+ */
+static void dentry_drop_entry(uint disk, uint n)
+{
+  uint i = 0;
+  for(i=0; i<DENTRY_NCACHED; i++) {
+    if(dentry[i].disk == disk && (dentry[i].n == n || dentry[i].parent == n)) {
+      dentry[i].name[0] = 0;
+    }
+  }
+}
+
+/*
+ * Drop all cached lookups of a disk
+ * disk can be UNKNOWN_VALUE to drop all of them
+ */
+static void dentry_drop_disk(uint disk)
+{
+  uint i = 0;
+  for(i=0; i<DENTRY_NCACHED; i++) {
+    if(disk == UNKNOWN_VALUE || dentry[i].disk == disk) {
+      dentry[i].name[0] = 0;
+    }
+  }
+}
+
+/*
+ * Mounted disks
+ *
+ * The superblock of each disk is read once and kept here, together
+ * with its allocation hint, so file system operations don't read it
+ * again. It's dropped when the disk is formatted or could have been
+ * replaced.
+ */
+static struct mount_info {
+  uint              mounted;    /* 1 if sb is valid */
+  sfs_superblock_t  sb;
+  uint              alloc_hint; /* Next block to check when allocating */
+} mount[MAX_DISK];
+
+/*
+ * Drop mounted disk info
+ * disk can be UNKNOWN_VALUE to drop all of them
+ */
+static void mount_drop(uint disk)
+{
+  uint i = 0;
+  for(i=0; i<MAX_DISK; i++) {
+    if(disk == UNKNOWN_VALUE || disk_info[i].id == disk) {
+      mount[i].mounted = 0;
+      mount[i].alloc_hint = 0;
+    }
+  }
+}
+
+/*
+ * Max number of sectors transferred at once.
+ * int 0x13 extensions do not transfer more than 127 sectors at once
+ */
+#define DISK_MAX_SECTORS 127
+
+/*
+ * Read or write n disk sectors through BIOS, to or from buff
+ * (linear address). BIOS transfers must not cross a 64KB bound,
+ * to avoid DMA error, so they are split at these bounds, and
+ * sectors which would cross one go through the bounce buffer
+ * Returns 0 on success, another value otherwise
+ */
+static uint bios_transfer(uint disk, ul_t sector, uint n, lp_t buff,
+  uint write)
+{
+  uint result = 0;
+  uint c = 0;
+
+  while(n > 0 && result == 0) {
+    /* Number of sectors before next 64KB bound */
+    c = (uint)((0x10000L - (buff & 0xFFFFL)) / SECTOR_SIZE);
+
+    if(c > 0) {
+      c = min(c, min(n, DISK_MAX_SECTORS));
+      if(write) {
+        result = write_disk_sector(disk, sector, c, buff);
+      } else {
+        result = read_disk_sector(disk, sector, c, buff);
+      }
+    } else {
+      c = min(n, BOUNCE_NSECTORS);
+      if(write) {
+        lmem_copy(BOUNCE_ADDR, buff, c*SECTOR_SIZE);
+        result = write_disk_sector(disk, sector, c, BOUNCE_ADDR);
+      } else {
+        result = read_disk_sector(disk, sector, c, BOUNCE_ADDR);
+        if(result == 0) {
+          lmem_copy(buff, BOUNCE_ADDR, c*SECTOR_SIZE);
+        }
+      }
+    }
+
+    sector += c;
+    buff += (lp_t)c*SECTOR_SIZE;
+    n -= c;
+  }
+
+  return result;
+}
+
+/*
+ * Read n disk sectors to buff (linear address)
+ * Disks with a native ATA device or floppy driver are read
+ * directly, and through BIOS otherwise or if the driver fails
+ * Returns 0 on success, another value otherwise
+ */
+static uint disk_read_sectors(uint disk, ul_t sector, uint n, lp_t buff)
+{
+  uint i = disk_to_index(disk);
+  if(disk_info[i].ata != 0 &&
+    ata_read(disk_info[i].ata, sector, n, buff) == 0) {
+    return 0;
+  }
+  if(disk_info[i].fdc != 0 && fdc_read(i, sector, n, buff) == 0) {
+    return 0;
+  }
+  return bios_transfer(disk, sector, n, buff, 0);
+}
+
+/*
+ * Write n disk sectors from buff (linear address)
+ * Same than disk_read_sectors
+ * Returns 0 on success, another value otherwise
+ */
+static uint disk_write_sectors(uint disk, ul_t sector, uint n, lp_t buff)
+{
+  uint i = disk_to_index(disk);
+  if(disk_info[i].ata != 0 &&
+    ata_write(disk_info[i].ata, sector, n, buff) == 0) {
+    return 0;
+  }
+  if(disk_info[i].fdc != 0 && fdc_write(i, sector, n, buff) == 0) {
+    return 0;
+  }
+  return bios_transfer(disk, sector, n, buff, 1);
+}
+
+/*
+ * Read-ahead
+ *
+ * When a file is read sequentially, the following sectors of the run
+ * of contiguous blocks being read are read in advance, with a single
+ * disk transfer, into a buffer in far memory. Following reads are
+ * then served from this buffer. Reading in advance stops at the first
+ * sector found in the disk cache, since it could be modified there.
+ * fs_readahead is the max number of sectors read in advance
+ */
+uint fs_readahead = 18;
+
+static struct readahead_info {
+  uint  disk;
+  ul_t  sector; /* First sector in buffer */
+  uint  n;      /* Number of sectors in buffer. 0 if empty */
+  uint  fdisk;  /* Disk of last read file */
+  uint  nentry; /* Head entry index of last read file */
+  uint  next;   /* Position of a sequential read of this file */
+} readahead;
+
+/*
+ * Discard read-ahead buffer if it contains sectors of disk
+ * If n is not 0, only if it contains any of n sectors from sector
+ * disk can be UNKNOWN_VALUE to discard it anyway
+ */
+static void readahead_drop(uint disk, ul_t sector, ul_t n)
+{
+  if(disk == UNKNOWN_VALUE || (readahead.disk == disk &&
+    (n == 0 || (sector < readahead.sector + readahead.n &&
+    sector + n > readahead.sector)))) {
+    readahead.n = 0;
+  }
+}
+
+/*
+ * Disk cache
+ *
+ * Recently used disk sectors are kept in far memory, so repeated
+ * accesses to the same sectors (superblock, entries...) are served
+ * with a memory copy instead of a disk access.
+ * Writes are delayed: modified sectors are only marked as dirty, and
+ * written to disk when evicted or when fs_cache_flush is called.
+ * When the cache is full, the least recently used sector is evicted.
+ */
+#define DC_VALID 0x01 /* Cached sector contains valid data */
+#define DC_DIRTY 0x02 /* Cached sector must be written to disk */
+
+static struct dcache_info {
+  uint  disk;
+  ul_t  sector;
+  uint  flags;
+  ul_t  last_use;
+} dcache[DCACHE_NSECTORS];
+
+static ul_t dcache_clock = 0; /* Incremented on each cache access */
+
+ul_t fs_cache_hits = 0;
+ul_t fs_cache_misses = 0;
+
+/*
+ * Get far memory address of a cached sector given its cache index
+ */
+static lp_t dcache_addr(uint i)
+{
+  return DCACHE_ADDR + (lp_t)i*(lp_t)SECTOR_SIZE;
+}
+
+/*
+ * Write a cached sector to disk if it's dirty
+ * Returns 0 on success, another value otherwise
+ */
+static uint dcache_write_back(uint i)
+{
+  uint result = 0;
+  if((dcache[i].flags & DC_VALID) && (dcache[i].flags & DC_DIRTY)) {
+    result = disk_write_sectors(dcache[i].disk, dcache[i].sector, 1,
+      dcache_addr(i));
+    if(result == 0) {
+      dcache[i].flags &= ~DC_DIRTY;
+    }
+  }
+  return result;
+}
+
+/*
+ * Write dirty sectors of a disk to disk, and optionally
+ * drop them from the cache.
+ * disk can be UNKNOWN_VALUE to apply this to all disks
+ * Returns 0 on success, another value otherwise
+ */
+static uint dcache_sync(uint disk, uint drop)
+{
+  uint result = 0;
+  uint i = 0;
+  for(i=0; i<DCACHE_NSECTORS; i++) {
+    if((dcache[i].flags & DC_VALID) &&
+      (disk == UNKNOWN_VALUE || dcache[i].disk == disk)) {
+      result |= dcache_write_back(i);
+      if(drop && !(dcache[i].flags & DC_DIRTY)) {
+        dcache[i].flags = 0;
+      }
+    }
+  }
+  return result;
+}
+
+/*
+ * Find a sector in cache
+ * Returns its cache index or ERROR_NOT_FOUND
+ */
+static uint dcache_find(uint disk, ul_t sector)
+{
+  uint i = 0;
+  for(i=0; i<DCACHE_NSECTORS; i++) {
+    if((dcache[i].flags & DC_VALID) &&
+      dcache[i].disk == disk && dcache[i].sector == sector) {
+      return i;
+    }
+  }
+  return ERROR_NOT_FOUND;
+}
+
+/*
+ * Floppy disks can be replaced once their motors are turned off,
+ * so drop all their cached information then. Modified sectors are
+ * written first, never dropped, but motors are only turned off
+ * once they have been written anyway (see fs_cache_idle).
+ * Any access, even a cache hit, marks the cache as valid again and
+ * counts as a disk access, so fs_cache_idle writes it later.
+ */
+static void disk_check_replaced(uint disk)
+{
+  uint index = disk_to_index(disk);
+  if(disk >= 0x80 || index >= MAX_DISK) {
+    return;
+  }
+  if(!disk_info[index].cached) {
+    dcache_sync(disk, 1);
+    readahead_drop(disk, 0, 0);
+    dentry_drop_disk(disk);
+    mount_drop(disk);
+    disk_info[index].cached = 1;
+  }
+  disk_info[index].last_access = system_timer_ms;
+}
+
+/*
+ * Get a sector in cache, reading it from disk if needed.
+ * If load is 0, the sector is not read from disk, because caller
+ * is going to overwrite it entirely
+ * Returns its cache index or ERROR_IO
+ */
+static uint dcache_get(uint disk, ul_t sector, uint load)
+{
+  uint i = 0;
+  uint result = 0;
+
+  /* Floppy disks could have been replaced */
+  disk_check_replaced(disk);
+
+  dcache_clock++;
+
+  /* Cache hit */
+  i = dcache_find(disk, sector);
+  if(i != ERROR_NOT_FOUND) {
+    fs_cache_hits++;
+    dcache[i].last_use = dcache_clock;
+    return i;
+  }
+
+  /* Cache miss: take a free or the least recently used sector */
+  fs_cache_misses++;
+  i = 0;
+  for(result=0; result<DCACHE_NSECTORS; result++) {
+    if(!(dcache[result].flags & DC_VALID)) {
+      i = result;
+      break;
+    }
+    if(dcache[result].last_use < dcache[i].last_use) {
+      i = result;
+    }
+  }
+
+  /* Write it to disk before reusing it */
+  if(dcache_write_back(i) != 0) {
+    return ERROR_IO;
+  }
+  dcache[i].flags = 0;
+
+  if(load && disk_read_sectors(disk, sector, 1, dcache_addr(i)) != 0) {
+    return ERROR_IO;
+  }
+
+  dcache[i].disk = disk;
+  dcache[i].sector = sector;
+  dcache[i].flags = DC_VALID;
+  dcache[i].last_use = dcache_clock;
+  return i;
+}
+
+/*
+ * Write all dirty cached sectors to disk
+ */
+uint fs_cache_flush()
+{
+  return dcache_sync(UNKNOWN_VALUE, 0);
+}
+
+/*
+ * Check if a disk has dirty cached sectors
+ */
+uint fs_cache_dirty(uint disk)
+{
+  uint i = 0;
+  for(i=0; i<DCACHE_NSECTORS; i++) {
+    if((dcache[i].flags & DC_DIRTY) && dcache[i].disk == disk) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Write dirty cached sectors of idle floppy disks
+ */
+void fs_cache_idle()
+{
+  uint i = 0;
+  for(i=0; i<MAX_DISK; i++) {
+    if(disk_info[i].id < 0x80 && disk_info[i].last_access != 0 &&
+      system_timer_ms - disk_info[i].last_access > FS_CACHE_IDLE_MS &&
+      fs_cache_dirty(disk_info[i].id)) {
+      dcache_sync(disk_info[i].id, 0);
+    }
+  }
+}
+
+/*
+ * Get superblock of a disk
+ * It's only read from disk the first time after mounting
+ * Returns 0 on success, or ERROR_IO
+ */
+static uint get_superblock(uint disk, sfs_superblock_t* sb)
+{
+  sfs_superblock_t* msb = 0;
+  uint disk_index = disk_to_index(disk);
+  uint i = 0;
+  if(disk_index >= MAX_DISK) {
+    return ERROR_IO;
+  }
+
+  /* Floppy disks could have been replaced */
+  disk_check_replaced(disk);
+
+  if(!mount[disk_index].mounted) {
+    /* The superblock is the second sector, whatever the block size.
+     * It's read through the cache, since blocks can't be used yet */
+    i = dcache_get(disk, 1, 1);
+    if(i >= ERROR_ANY) {
+      return ERROR_IO;
+    }
+    lmem_copy(lp(&mount[disk_index].sb), dcache_addr(i), sizeof(*sb));
+
+    /* Revisions before 1.5 have 512 bytes blocks. A bad block size
+     * means this is not a valid file system */
+    msb = &mount[disk_index].sb;
+    if(msb->type < SFS_TYPE_ID_1_5 || msb->type > SFS_TYPE_ID) {
+      msb->blocksize = BLOCK_SIZE;
+    } else if(msb->blocksize < BLOCK_SIZE ||
+      msb->blocksize > SFS_MAXBLOCKSIZE ||
+      (msb->blocksize & (msb->blocksize - 1))) {
+      msb->type = 0;
+      msb->blocksize = BLOCK_SIZE;
+    }
+
+    /* Older revisions have no high-water mark: any entry could be used */
+    if(msb->type != SFS_TYPE_ID || msb->entryhwm > msb->nentries) {
+      msb->entryhwm = msb->nentries;
+    }
+    mount[disk_index].mounted = 1;
+  }
+
+  memcpy(sb, &mount[disk_index].sb, sizeof(*sb));
+  return 0;
+}
+
+/*
+ * Get block size of a disk in bytes
+ * The disk is mounted if needed. BLOCK_SIZE is returned only if its
+ * superblock can't be read, and then accessing the disk fails anyway
+ */
+static uint disk_block_size(uint disk)
+{
+  sfs_superblock_t sb;
+  if(get_superblock(disk, &sb) != 0) {
+    return BLOCK_SIZE;
+  }
+  return (uint)sb.blocksize;
+}
+
+/*
+ * Check if entry n of a disk is past its entries high-water mark,
+ * so it was never used. The disk is mounted if needed
+ */
+static uint entry_past_hwm(uint disk, uint n)
+{
+  sfs_superblock_t sb;
+  if(get_superblock(disk, &sb) != 0) {
+    return 0;
+  }
+  return (ul_t)n >= sb.entryhwm;
+}
+
+/*
+ * Read count bytes through the read-ahead buffer, starting at block
+ * and offset. run is the number of contiguous blocks from block
+ * Returns 0 on success, another value otherwise
+ */
+static uint readahead_read(uint disk, uint block, uint offset, uint count,
+  uint run, lp_t buff)
+{
+  ul_t bs = disk_block_size(disk);
+  ul_t sector = ((ul_t)block * bs + offset) / SECTOR_SIZE;
+  ul_t end = ((ul_t)block + run) * bs / SECTOR_SIZE;
+  uint hit = 0;
+  uint n = 0;
+  uint c = 0;
+  uint result = 0;
+
+  /* Floppy disks could have been replaced */
+  disk_check_replaced(disk);
+
+  offset = offset % SECTOR_SIZE;
+  while(count > 0) {
+    hit = readahead.n != 0 && readahead.disk == disk &&
+      sector >= readahead.sector && sector < readahead.sector + readahead.n;
+
+    /* Fill buffer, starting at this sector */
+    if(!hit) {
+      n = (uint)min(end - sector, (ul_t)min(fs_readahead, READAHEAD_NSECTORS));
+      c = 0;
+      while(c < n && dcache_find(disk, sector + c) == ERROR_NOT_FOUND) {
+        c++;
+      }
+      if(c > 0) {
+        readahead.n = 0;
+        result = disk_read_sectors(disk, sector, c, READAHEAD_ADDR);
+        if(result != 0) {
+          return result;
+        }
+        readahead.disk = disk;
+        readahead.sector = sector;
+        readahead.n = c;
+        hit = 1;
+      }
+    }
+
+    if(hit) {
+      c = (uint)min((readahead.sector + readahead.n - sector) * SECTOR_SIZE -
+        offset, (ul_t)count);
+      lmem_copy(buff, READAHEAD_ADDR +
+        (sector - readahead.sector) * SECTOR_SIZE + offset, c);
+    } else {
+      /* This sector is cached */
+      c = min(SECTOR_SIZE - offset, count);
+      result = dcache_get(disk, sector, 1);
+      if(result >= ERROR_ANY) {
+        return result;
+      }
+      lmem_copy(buff, dcache_addr(result) + (lp_t)offset, c);
+    }
+
+    buff += c;
+    count -= c;
+    sector += (offset + c) / SECTOR_SIZE;
+    offset = (offset + c) % SECTOR_SIZE;
+  }
+
+  return 0;
+}
+
 /*
  * Read disk, specific block, offset and size
  * Returns 0 on success, another value otherwise
  */
-static uint read_disk(uint disk, uint block, uint offset, uint buff_size, uchar* buff)
+static uint read_disk(uint disk, ul_t block, uint offset, uint buff_size, lp_t buff)
 {
-/*  uchar* aux_buff; [SECTOR_SIZE];*/
   uint n_sectors = 0;
   uint i = 0;
+  uint c = 0;
   uint result = 0;
-  uint sector = 0;
+  ul_t sector = 0;
 
   /* Check params */
   if(buff == 0) {
@@ -142,61 +766,45 @@ static uint read_disk(uint disk, uint block, uint offset, uint buff_size, uchar*
     return 1;
   }
 
-  /* Convert blocks to sectors */
-  if(BLOCK_SIZE >= SECTOR_SIZE) {
-    sector = block * (BLOCK_SIZE / SECTOR_SIZE);
-  } else {
-    sector = (block * BLOCK_SIZE) / SECTOR_SIZE;
-  }
+  /* Convert blocks to sectors. Blocks are never smaller than sectors */
+  sector = block * (disk_block_size(disk) / SECTOR_SIZE);
 
   /* Compute initial sector and offset */
   sector += offset / SECTOR_SIZE;
   offset = offset % SECTOR_SIZE;
 
-  /* read_disk_sector can only read entire and aligned sectors.
-   * If requested offset is unaligned to sectors, read an entire
-   * sector and copy only requested bytes in buff */
-  if(offset) {
-    result = read_disk_sector(disk, sector, 1, disk_buff);
-    i = min(SECTOR_SIZE-offset, buff_size);
-    memcpy(buff, &disk_buff[offset], i);
-    sector++;
-    buff_size -= i;
-  }
-
-  /* Now read aligned an entire sectors */
-  n_sectors = buff_size / SECTOR_SIZE;
-
-  if(n_sectors && result == 0) {
-    /* Try to read all sectors at once */
-    result = read_disk_sector(disk, sector, n_sectors, &buff[i]);
-
-    /* Handle DMA access 64kb boundary. Read sector by sector */
-    if(result == 0x900) {
-      debugstr("Read disk: DMA access accross 64Kb boundary. Reading sector by sector\n\r");
-      for(; n_sectors > 0; n_sectors--) {
-        result = read_disk_sector(disk, sector, 1, disk_buff);
-        if(result != 0) {
-          break;
-        }
-        memcpy(&buff[i], disk_buff, SECTOR_SIZE);
-        i += SECTOR_SIZE;
-        sector++;
-        buff_size -= SECTOR_SIZE;
+  while(buff_size > 0 && result == 0) {
+    /* Runs of entire sectors which are not cached are read
+     * all at once, directly in buff, and not cached */
+    n_sectors = 0;
+    if(offset == 0) {
+      c = min(buff_size / SECTOR_SIZE, DISK_MAX_SECTORS);
+      while(n_sectors < c &&
+        dcache_find(disk, sector + n_sectors) == ERROR_NOT_FOUND) {
+        n_sectors++;
       }
-    } else {
-      buff_size -= SECTOR_SIZE * n_sectors;
-      sector += n_sectors;
-      i += SECTOR_SIZE * n_sectors;
     }
-  }
 
-  /* read_disk_sector can only read entire and aligned sectors.
-   * If requested size exceeds entire sectors, read
-   * an entire sector and copy only requested bytes */
-  if(buff_size && result == 0) {
-    result = read_disk_sector(disk, sector, 1, disk_buff);
-    memcpy(&buff[i], disk_buff, buff_size);
+    if(n_sectors > 1) {
+      result = disk_read_sectors(disk, sector, n_sectors, buff + i);
+      c = SECTOR_SIZE * n_sectors;
+    }
+
+    /* Otherwise, read one sector through the cache */
+    if(n_sectors <= 1) {
+      n_sectors = 1;
+      c = min(SECTOR_SIZE - offset, buff_size);
+      result = dcache_get(disk, sector, 1);
+      if(result < ERROR_ANY) {
+        lmem_copy(buff + i, dcache_addr(result) + (lp_t)offset, c);
+        result = 0;
+      }
+    }
+
+    sector += n_sectors;
+    buff_size -= c;
+    i += c;
+    offset = 0;
   }
 
   if(result != 0) {
@@ -210,12 +818,14 @@ static uint read_disk(uint disk, uint block, uint offset, uint buff_size, uchar*
  * Write disk, specific sector, offset and size
  * Returns 0 on success, another value otherwise
  */
-static uint write_disk(uint disk, uint block, uint offset, uint buff_size, uchar* buff)
+static uint write_disk(uint disk, ul_t block, uint offset, uint buff_size, lp_t buff)
 {
   uint n_sectors = 0;
   uint i = 0;
+  uint c = 0;
+  ul_t s = 0;
   uint result = 0;
-  uint sector = 0;
+  ul_t sector = 0;
 
   /* Check params */
   if(buff == 0) {
@@ -228,62 +838,53 @@ static uint write_disk(uint disk, uint block, uint offset, uint buff_size, uchar
     return 1;
   }
 
-  /* Convert blocks to sectors */
-  if(BLOCK_SIZE >= SECTOR_SIZE) {
-    sector = block * (BLOCK_SIZE / SECTOR_SIZE);
-  } else {
-    sector = (block * BLOCK_SIZE) / SECTOR_SIZE;
-  }
+  /* Convert blocks to sectors. Blocks are never smaller than sectors */
+  sector = block * (disk_block_size(disk) / SECTOR_SIZE);
 
   /* Compute initial sector and offset */
   sector += offset / SECTOR_SIZE;
   offset = offset % SECTOR_SIZE;
 
-  /* write_disk_sector can only write entire and aligned sectors.
-   * If requested offset is unaligned to sectors, read an entire
-   * sector, overwrite requested bytes, and write it */
-  if(offset) {
-    result += read_disk_sector(disk, sector, 1, disk_buff);
-    i = min(SECTOR_SIZE-offset, buff_size);
-    memcpy(&disk_buff[offset], buff, i);
-    result += write_disk_sector(disk, sector, 1, disk_buff);
-    sector++;
-    buff_size -= i;
-  }
-
-  /* Now write aligned an entire sectors */
-  n_sectors = buff_size / SECTOR_SIZE;
-
-  if(n_sectors && result == 0) {
-    /* Try to write all sectors at once */
-    result += write_disk_sector(disk, sector, n_sectors, &buff[i]);
-    /* Handle DMA access 64kb boundary. Write sector by sector */
-    if(result == 0x900) {
-      debugstr("Write disk: DMA access accross 64Kb boundary. Writting sector by sector\n\r");
-      for(; n_sectors > 0; n_sectors--) {
-        memcpy(disk_buff, &buff[i], SECTOR_SIZE);
-        result = write_disk_sector(disk, sector, 1, disk_buff);
-        if(result != 0) {
-          break;
+  /* Data read in advance becomes outdated */
+  readahead_drop(disk, sector,
+    ((ul_t)offset + buff_size + SECTOR_SIZE - 1) / SECTOR_SIZE);
+
+  while(buff_size > 0 && result == 0) {
+    /* Runs of entire sectors are written all at once,
+     * directly from buff. Cached copies become outdated */
+    n_sectors = 0;
+    if(offset == 0) {
+      n_sectors = min(buff_size / SECTOR_SIZE, DISK_MAX_SECTORS);
+    }
+
+    if(n_sectors > 1) {
+      for(s=sector; s<sector+n_sectors; s++) {
+        c = dcache_find(disk, s);
+        if(c != ERROR_NOT_FOUND) {
+          dcache[c].flags = 0;
         }
-        i += SECTOR_SIZE;
-        sector++;
-        buff_size -= SECTOR_SIZE;
       }
-    } else {
-      buff_size -= SECTOR_SIZE * n_sectors;
-      sector += n_sectors;
-      i += SECTOR_SIZE * n_sectors;
+      result = disk_write_sectors(disk, sector, n_sectors, buff + i);
+      c = SECTOR_SIZE * n_sectors;
+    }
+
+    /* Otherwise, write one sector in the cache. It's only read
+     * from disk first if it's going to be partially overwritten */
+    if(n_sectors <= 1) {
+      n_sectors = 1;
+      c = min(SECTOR_SIZE - offset, buff_size);
+      result = dcache_get(disk, sector, c != SECTOR_SIZE);
+      if(result < ERROR_ANY) {
+        lmem_copy(dcache_addr(result) + (lp_t)offset, buff + i, c);
+        dcache[result].flags |= DC_DIRTY;
+        result = 0;
+      }
     }
-  }
 
-  /* write_disk_sector can only write entire and aligned sectors.
-   * If requested size exceeds entire sectors, read
-   * an entire sector, overwrite requested bytes, and write */
-  if(buff_size && result == 0) {
-    result += read_disk_sector(disk, sector, 1, disk_buff);
-    memcpy(disk_buff, &buff[i], buff_size);
-    result += write_disk_sector(disk, sector, 1, disk_buff);
+    sector += n_sectors;
+    buff_size -= c;
+    i += c;
+    offset = 0;
   }
 
   if(result != 0) {
@@ -338,6 +939,13 @@ void fs_init_info()
   uint result = 0;
   uint disk_index = 0;
 
+  /* Disks could have been replaced: write pending
+   * changes and empty the disk cache */
+  dcache_sync(UNKNOWN_VALUE, 1);
+  readahead_drop(UNKNOWN_VALUE, 0, 0);
+  dentry_drop_disk(UNKNOWN_VALUE);
+  mount_drop(UNKNOWN_VALUE);
+
   /* For each disk */
   for(disk_index=0; disk_index<MAX_DISK; disk_index++) {
     debugstr("Check filesystem in %x: ", index_to_disk(disk_index));
@@ -346,13 +954,19 @@ void fs_init_info()
     if(disk_info[disk_index].size != 0) {
       /* Read superblock and check file system type and data */
       sfs_superblock_t sb;
-      result = read_disk(index_to_disk(disk_index), 1, 0, sizeof(sb), &sb);
+      result = get_superblock(index_to_disk(disk_index), &sb);
       if(result == 0 && sb.type == SFS_TYPE_ID) {
         disk_info[disk_index].fstype = FS_TYPE_NSFS;
-        disk_info[disk_index].fssize = sb.size;
+        disk_info[disk_index].fssize = sb.size * (sb.blocksize / BLOCK_SIZE);
         debugstr("NSFS\n\r");
         continue;
       }
+      if(result == 0 && sb.type >= SFS_TYPE_ID_1_0 && sb.type < SFS_TYPE_ID) {
+        disk_info[disk_index].fstype = FS_TYPE_NSFS_RO;
+        disk_info[disk_index].fssize = sb.size * (sb.blocksize / BLOCK_SIZE);
+        debugstr("NSFS older revision (read only)\n\r");
+        continue;
+      }
     }
     disk_info[disk_index].fstype = FS_TYPE_UNKNOWN;
     disk_info[disk_index].fssize = 0;
@@ -441,22 +1055,68 @@ static uint path_parse_disk_parent_name(uchar** name, uint* parent, uint* disk,
   return 0;
 }
 
+/*
+ * Get block of the entries table containing entry n of a disk
+ * Output: offset, position of the entry in that block
+ */
+static ul_t entry_block(uint disk, uint n, uint* offset)
+{
+  ul_t bs = disk_block_size(disk);
+  ul_t position = (ul_t)n * sizeof(sfs_entry_t);
+
+  *offset = (uint)(position % bs);
+  return SFS_ENTRIESSTART(bs) + position / bs;
+}
+
 /*
  * Get entry by disk and index
  * Returns the input index or ERROR_IO. Does check nothing
  */
 static uint get_entry_n(sfs_entry_t* entry, uint disk, uint n)
 {
+  uint offset = 0;
+  ul_t block = 0;
+  uint result = 0;
+
+  /* Entries past the high-water mark are free, and not read */
+  if(entry_past_hwm(disk, n)) {
+    memset(entry, 0, sizeof(sfs_entry_t));
+    return n;
+  }
+
   /* Compute block number and offset */
-  uint32_t block = 2L +
-    ((uint32_t)n*(uint32_t)sizeof(sfs_entry_t))/(uint32_t)BLOCK_SIZE;
+  block = entry_block(disk, n, &offset);
+
+  /* Read and return */
+  result = read_disk(disk, block, offset,
+    sizeof(sfs_entry_t), lp(entry));
+
+  return result != 0 ? ERROR_IO : n;
+}
+
+/*
+ * Get flags and name of an entry by disk and index
+ * Reads only the beginning of the entry in head
+ * Returns the input index or ERROR_IO. Does check nothing
+ */
+static uint get_entry_head(uchar* head, uint disk, uint n)
+{
+  uint offset = 0;
+  ul_t block = 0;
+  uint result = 0;
+
+  /* Entries past the high-water mark are free, and not read */
+  if(entry_past_hwm(disk, n)) {
+    memset(head, 0, 1 + SFS_NAMESIZE);
+    return n;
+  }
 
-  uint32_t offset = ((uint32_t)n *
-    (uint32_t)sizeof(sfs_entry_t)) % (uint32_t)BLOCK_SIZE;
+  /* Compute block number and offset */
+  block = entry_block(disk, n, &offset);
 
   /* Read and return */
-  uint result = read_disk(disk, (uint)block, (uint)offset,
-    sizeof(sfs_entry_t), entry);
+  result = read_disk(disk, block, offset,
+    1 + SFS_NAMESIZE, lp(head));
 
   return result != 0 ? ERROR_IO : n;
 }
@@ -467,7 +1127,11 @@ static uint get_entry_n(sfs_entry_t* entry, uint disk, uint n)
 uint fs_get_entry(sfs_entry_t* entry, uchar* path, uint parent, uint disk)
 {
   sfs_superblock_t sb;
+  uchar head[1 + SFS_NAMESIZE];
+  uint hashed = 0;
+  uint hash = 0;
   uint n = 0;
+  uint r = 0;
   uint result = 0;
   uchar* name = 0;
 
@@ -496,122 +1160,460 @@ uint fs_get_entry(sfs_entry_t* entry, uchar* path, uint parent, uint disk)
     path = name;
   }
 
-  /* Read superblock */
-  result = read_disk(disk, 1, 0, sizeof(sb), &sb);
-  if(result != 0) {
-    return ERROR_IO;
+  /* The root directory is not referenced by any directory */
+  if(parent == 0 && !strcmp(path, ROOT_DIR_NAME)) {
+    return get_entry_n(entry, disk, 0);
+  }
+
+  /* Check lookup cache */
+  if(dentry_find(disk, parent, path, &n)) {
+    if(n == ERROR_NOT_FOUND) {
+      return n;
+    }
+    return get_entry_n(entry, disk, n);
+  }
+
+  /* Read parent directory */
+  result = get_entry_n(entry, disk, parent);
+  if(result >= ERROR_ANY) {
+    return result;
+  }
+  if(!(entry->flags & T_DIR)) {
+    return ERROR_NOT_FOUND;
+  }
+
+  /* Older revisions have no name hashes in references */
+  result = get_superblock(disk, &sb);
+  if(result != 0) {
+    return ERROR_IO;
+  }
+  hashed = sb.type == SFS_TYPE_ID;
+  hash = SFS_REFHASH(dir_ref(0, path));
+
+  /* Check only entries referenced by the parent directory,
+   * advancing through its chained entries. When hashes are
+   * available, only subentries with the same hash are read */
+  while(1) {
+    for(r=0; r<min((uint)entry->size, SFS_ENTRYREFS); r++) {
+      if(hashed && SFS_REFHASH(entry->ref[r]) != hash) {
+        continue;
+      }
+      n = get_entry_head(head, disk, SFS_REFENTRY(entry->ref[r]));
+      if(n >= ERROR_ANY) {
+        return n;
+      }
+      if((head[0] & F_USED) && !strcmp(&head[1], path)) {
+        dentry_add(disk, parent, path, n);
+        return get_entry_n(entry, disk, n);
+      }
+    }
+    if(entry->next == 0) {
+      break;
+    }
+    result = get_entry_n(entry, disk, (uint)entry->next);
+    if(result >= ERROR_ANY) {
+      return result;
+    }
+  }
+
+  dentry_add(disk, parent, path, ERROR_NOT_FOUND);
+  return ERROR_NOT_FOUND;
+}
+
+/*
+ * When the number of references in an entry is not enough to fit contents,
+ * a chained entry for the same file or directory is created.
+ *
+ * Given the first entry of a file or directory (entry), and a reference
+ * index (nref), this function finds the chained entry (outentry) which
+ * contains its nref-th reference.
+ * disk id and index of input entry must be also provided.
+ * Returns the index of outentry in the entry table, or an error code
+ */
+static uint get_nref_entry_from_entry(sfs_entry_t* outentry,
+  sfs_entry_t* entry, uint disk, uint nentry, uint nref)
+{
+  /* Initialize return entry information to the first entry */
+  uint result = nentry;
+  memcpy(outentry, entry, sizeof(sfs_entry_t));
+
+  /* While reference index exceeds number of references in an entry */
+  while((nref = nref / SFS_ENTRYREFS) > 0) {
+    if(outentry->next) {
+      /* Advance tot he next chained entry */
+      result = get_entry_n(outentry, disk, (uint)outentry->next);
+      if(result >= ERROR_ANY) {
+        return result;
+      }
+    } else {
+      return ERROR_NOT_FOUND;
+    }
+  }
+  return result;
+}
+
+/*
+ * Open files
+ *
+ * Open files keep their disk and head entry index, so they are looked up
+ * only once, and the current position. They also keep an index of their
+ * chained entries, so the entry containing any position is found directly,
+ * without walking the chain again on each access.
+ */
+#define FILE_MAXCHAIN 4 /* Files are at most 64KB, so they never need more */
+
+typedef struct {
+  uint  disk;
+  uint  nentry;   /* Head entry index. 0 if unused */
+  uint  position; /* Current position (bytes) */
+  uint  nchain;   /* Number of indexed chained entries. 0 if not indexed */
+  uint  chain[FILE_MAXCHAIN];    /* Chained entry indexes, head first */
+  uint  chainref[FILE_MAXCHAIN]; /* Number of first block of each one */
+} sfs_file_t;
+
+static sfs_file_t open_files[FS_MAX_FILES];
+static ata_request_t file_requests[FS_MAX_FILES]; /* Asynchronous reads */
+
+/*
+ * Forget the chained entries index of open files of an entry
+ * Call this when its chain is modified
+ */
+static void files_reset_chain(uint disk, uint nentry)
+{
+  uint i = 0;
+  for(i=0; i<FS_MAX_FILES; i++) {
+    if(open_files[i].nentry == nentry && open_files[i].disk == disk) {
+      open_files[i].nchain = 0;
+    }
+  }
+}
+
+/*
+ * Close open files of an entry
+ * Call this when it's deleted
+ * nentry can be UNKNOWN_VALUE to close all open files of disk
+ */
+static void files_close(uint disk, uint nentry)
+{
+  uint i = 0;
+  for(i=0; i<FS_MAX_FILES; i++) {
+    if(open_files[i].disk == disk &&
+      (nentry == UNKNOWN_VALUE || open_files[i].nentry == nentry)) {
+      open_files[i].nentry = 0;
+    }
+  }
+}
+
+/*
+ * Get number of file blocks a single chained entry of a file can contain
+ * For files with extents, the number of blocks in its extents
+ * Inline files have no blocks
+ */
+static uint entry_nblocks(sfs_entry_t* entry)
+{
+  uint nblocks = 0;
+  uint i = 0;
+
+  if(entry->flags & F_INLINE) {
+    return 0;
+  }
+
+  if(!(entry->flags & F_EXTENTS)) {
+    return SFS_ENTRYREFS;
+  }
+
+  for(i=0; i<SFS_ENTRYREFS; i+=2) {
+    nblocks += (uint)entry->ref[i+1];
   }
+  return nblocks;
+}
 
-  /* Check all entries */
-  while(n < sb.nentries) {
-    result = get_entry_n(entry, disk, n);
-    if(result >= ERROR_ANY) {
-      return result;
-    }
-    if((entry->flags & F_USED) && entry->parent == parent &&
-      !strcmp(entry->name, path)) {
-      return n;
+/*
+ * Get the data block of block n of a chained entry of a file
+ * n is relative to the first block of this chained entry
+ * Output: run, number of contiguous data blocks starting at that one
+ * Returns the data block index, or 0 if there is not such block
+ */
+static uint entry_get_block(sfs_entry_t* entry, uint n, uint* run)
+{
+  uint i = 0;
+
+  if(entry->flags & F_INLINE) {
+    *run = 0;
+    return 0;
+  }
+
+  /* Find the extent containing this block */
+  if(entry->flags & F_EXTENTS) {
+    for(i=0; i<SFS_ENTRYREFS; i+=2) {
+      if(n < (uint)entry->ref[i+1]) {
+        *run = (uint)entry->ref[i+1] - n;
+        return (uint)entry->ref[i] + n;
+      }
+      n -= (uint)entry->ref[i+1];
     }
-    n++;
+    *run = 0;
+    return 0;
   }
 
-  return ERROR_NOT_FOUND;
+  /* Single references: count contiguous ones */
+  if(n >= SFS_ENTRYREFS) {
+    *run = 0;
+    return 0;
+  }
+  *run = 1;
+  while(n + *run < SFS_ENTRYREFS &&
+    entry->ref[n + *run] == entry->ref[n] + *run) {
+    (*run)++;
+  }
+  return (uint)entry->ref[n];
 }
 
 /*
- * When the number of references in an entry is not enough to fit contents,
- * a chained entry for the same file or directory is created.
- *
- * Given the first entry of a file or directory (entry), and a reference
- * index (nref), this function finds the chained entry (outentry) which
- * contains its nref-th reference.
- * disk id and index of input entry must be also provided.
- * Returns the index of outentry in the entry table, or an error code
+ * Get the chained entry of a file containing a given block
+ * Output: entry, and first, number of the first block of this entry
+ * Chained entries are indexed on first use, so afterwards
+ * the right one is found directly. Inline files have a single
+ * entry, which is returned for any block
+ * Returns its index, ERROR_NOT_FOUND if the file has not such block,
+ * or another error code
  */
-static uint get_nref_entry_from_entry(sfs_entry_t* outentry,
-  sfs_entry_t* entry, uint disk, uint nentry, uint nref)
+static uint file_get_entry(sfs_file_t* f, sfs_entry_t* entry, uint block,
+  uint* first)
 {
-  /* Initialize return entry information to the first entry */
-  uint result = nentry;
-  memcpy(outentry, entry, sizeof(sfs_entry_t));
+  uint result = 0;
+  uint nblocks = 0;
+  uint n = 0;
+  uint i = 0;
 
-  /* While reference index exceeds number of references in an entry */
-  while((nref = nref / SFS_ENTRYREFS) > 0) {
-    if(outentry->next) {
-      /* Advance tot he next chained entry */
-      result = get_entry_n(outentry, disk, (uint)outentry->next);
+  /* Index chained entries */
+  if(f->nchain == 0) {
+    n = f->nentry;
+    while(n != 0 && f->nchain < FILE_MAXCHAIN) {
+      result = get_entry_n(entry, f->disk, n);
       if(result >= ERROR_ANY) {
+        f->nchain = 0;
         return result;
       }
-    } else {
-      return ERROR_NOT_FOUND;
+      f->chain[f->nchain] = n;
+      f->chainref[f->nchain] = nblocks;
+      f->nchain++;
+      nblocks += entry_nblocks(entry);
+      n = (uint)entry->next;
     }
   }
+
+  /* Find the last chained entry starting before block */
+  i = f->nchain - 1;
+  while(i > 0 && block < f->chainref[i]) {
+    i--;
+  }
+
+  result = get_entry_n(entry, f->disk, f->chain[i]);
+  if(result >= ERROR_ANY) {
+    return result;
+  }
+  if(!(entry->flags & F_INLINE) &&
+    block >= f->chainref[i] + entry_nblocks(entry)) {
+    return ERROR_NOT_FOUND;
+  }
+
+  *first = f->chainref[i];
   return result;
 }
 
 /*
- * Read file in buff, given path, offset and count
+ * Read count bytes of a file in buff, starting at its position
+ * Returns number of readed bytes or an error code
  */
-uint fs_read_file(uchar* buff, uchar* path, uint offset, uint count)
+static uint file_read(sfs_file_t* f, lp_t buff, uint count)
 {
   sfs_entry_t entry;
-  uint nentry = 0;
-  uint result = 0;
+  uint size = 0;
   uint read = 0;
   uint block = 0;
+  uint first = 0;
+  uint offset = 0;
+  uint run = 0;
+  uint c = 0;
+  uint seq = 0;
+  uint bs = disk_block_size(f->disk);
+
+  /* Get chained entry for current position */
+  uint result = file_get_entry(f, &entry, f->position / bs, &first);
+  if(result == ERROR_NOT_FOUND) {
+    return 0;
+  }
+  if(result >= ERROR_ANY) {
+    return result;
+  }
 
-  /* Find entry */
-  uint disk = path_get_disk(path);
-  nentry = fs_get_entry(&entry, path, UNKNOWN_VALUE, UNKNOWN_VALUE);
-  if(nentry < ERROR_ANY && (entry.flags & T_FILE)) {
-    /* Compute initial block and offset */
-    offset = min(offset, entry.size);
-    count = min(count, entry.size - offset);
-    block = offset / BLOCK_SIZE;
-    offset = offset % BLOCK_SIZE;
-    while(read < count) {
-      /* Get chained entry for a given reference index number */
-      nentry = get_nref_entry_from_entry(&entry, &entry, disk, nentry, block);
-      if(nentry >= ERROR_ANY) {
-        return nentry;
+  /* Size of chained entries starts at their first block */
+  size = (uint)entry.size + first*bs;
+  if(f->position >= size) {
+    return 0;
+  }
+  count = min(count, size - f->position);
+
+  /* Inline data is in the entry itself */
+  if(entry.flags & F_INLINE) {
+    lmem_copy(buff, lp((uchar*)entry.ref + f->position), count);
+    f->position += count;
+    return count;
+  }
+
+  /* Check if this file is being read sequentially */
+  seq = readahead.fdisk == f->disk && readahead.nentry == f->nentry &&
+    readahead.next == f->position;
+
+  while(read < count) {
+    /* Advance to next chained entry if needed */
+    block = f->position / bs;
+    if(block >= first + entry_nblocks(&entry)) {
+      result = file_get_entry(f, &entry, block, &first);
+      if(result >= ERROR_ANY) {
+        return result;
       }
-      block = block % SFS_ENTRYREFS;
+    }
+
+    /* Read in buffer, all contiguous blocks at once */
+    offset = f->position % bs;
+    block = entry_get_block(&entry, block - first, &run);
+    if(block == 0) {
+      return ERROR_IO;
+    }
+    c = (uint)min((ul_t)run*bs - offset, (ul_t)(count - read));
+
+    /* Small sequential reads use read-ahead */
+    if(seq && c < min(fs_readahead, READAHEAD_NSECTORS) * SECTOR_SIZE) {
+      result = readahead_read(f->disk, block, offset, c, run, buff + read);
+    } else {
+      result = read_disk(f->disk, block, offset, c, buff + read);
+    }
+    if(result != 0) {
+      return ERROR_IO;
+    }
+
+    read += c;
+    f->position += c;
+  }
+
+  readahead.fdisk = f->disk;
+  readahead.nentry = f->nentry;
+  readahead.next = f->position;
+  return read;
+}
 
-      /* Read in buffer */
-      result = read_disk(disk, (uint)entry.ref[block % SFS_ENTRYREFS], offset,
-        (uint)min(BLOCK_SIZE-offset, count-read), &(buff[read]));
+/*
+ * Find a clear bit in a bitmap stored in disk, starting at mapstart block
+ * Bits first to max-1 are checked, starting at bit start and wrapping
+ * around at the end
+ * Returns the index of the bit, ERROR_NO_SPACE if all are set,
+ * or another error code
+ */
+static uint bitmap_find(uint disk, uint mapstart, uint first, uint max, uint start)
+{
+  uchar map[64];
+  uint chunk = UNKNOWN_VALUE;
+  uint result = 0;
+  uint bit = start;
+  uint n = 0;
+  uint i = 0;
+
+  if(bit < first || bit >= max) {
+    bit = first;
+  }
 
+  /* Check each bit once */
+  for(n=first; n<max; n++) {
+    /* Read the piece of bitmap containing this bit */
+    if(bit / (sizeof(map)*8) != chunk) {
+      chunk = bit / (sizeof(map)*8);
+      result = read_disk(disk, mapstart, chunk*sizeof(map), sizeof(map), lp(map));
       if(result != 0) {
         return ERROR_IO;
       }
+    }
+
+    i = bit % (sizeof(map)*8);
+    if(!(map[i/8] & (1 << (i%8)))) {
+      return bit;
+    }
 
-      read += min(BLOCK_SIZE - offset, count-read);
-      block++;
-      offset = 0;
+    bit++;
+    if(bit >= max) {
+      bit = first;
     }
-    result = read;
+  }
+
+  return ERROR_NO_SPACE;
+}
+
+/*
+ * Set (used != 0) or clear (used == 0) bit n of a bitmap stored in disk,
+ * starting at mapstart block
+ * Returns 0 on success, or an error code
+ */
+static uint bitmap_set(uint disk, uint mapstart, uint n, uint used)
+{
+  uchar b = 0;
+  uchar nb = 0;
+
+  uint result = read_disk(disk, mapstart, n/8, 1, lp(&b));
+  if(result != 0) {
+    return ERROR_IO;
+  }
+
+  if(used) {
+    nb = b | (1 << (n%8));
   } else {
-    result = nentry;
+    nb = b & ~(1 << (n%8));
   }
-  return result;
+
+  /* Write only if changed */
+  if(nb != b) {
+    result = write_disk(disk, mapstart, n/8, 1, lp(&nb));
+  }
+
+  return result != 0 ? ERROR_IO : 0;
 }
 
 /*
  * Write entry by index at disk
+ * The entries bitmap is updated according to entry flags, and the
+ * entries high-water mark is raised when a used entry is past it
  */
 static uint write_entry(sfs_entry_t* entry, uint disk, uint n)
 {
+  sfs_superblock_t sb;
+  uint disk_index = disk_to_index(disk);
+
   /* Compute block number and offset */
-  uint32_t block = 2L +
-    ((uint32_t)n*(uint32_t)sizeof(sfs_entry_t))/(uint32_t)BLOCK_SIZE;
+  uint offset = 0;
+  ul_t block = entry_block(disk, n, &offset);
+
+  /* Write */
+  uint result = write_disk(disk, block, offset,
+    sizeof(sfs_entry_t), lp(entry));
+  if(result != 0) {
+    return ERROR_IO;
+  }
+
+  /* Update entries bitmap */
+  result = get_superblock(disk, &sb);
+  if(result != 0) {
+    return ERROR_IO;
+  }
 
-  uint32_t offset = ((uint32_t)n *
-    (uint32_t)sizeof(sfs_entry_t)) % (uint32_t)BLOCK_SIZE;
+  result = bitmap_set(disk, (uint)sb.entrymapstart, n, entry->flags & F_USED);
+  if(result != 0 || !(entry->flags & F_USED) || (ul_t)n < sb.entryhwm) {
+    return result;
+  }
 
-  /* Write and return */
-  uint result = write_disk(disk, (uint)block, (uint)offset,
-    sizeof(sfs_entry_t), (uchar*)entry);
+  /* Raise high-water mark in superblock */
+  mount[disk_index].sb.entryhwm = (ul_t)n + 1;
+  result = write_disk(disk, 0, SECTOR_SIZE, sizeof(sfs_superblock_t),
+    lp(&mount[disk_index].sb));
 
   return result != 0 ? ERROR_IO : 0;
 }
@@ -653,97 +1655,239 @@ static uint set_entry_time_to_current(uint disk, uint nentry)
 static uint find_free_entry(uint disk)
 {
   sfs_superblock_t sb;
-  sfs_entry_t entry;
-  uint n = 0;
 
   /* Read super block */
-  uint result = read_disk(disk, 1, 0, sizeof(sb), &sb);
+  uint result = get_superblock(disk, &sb);
   if(result != 0) {
     return ERROR_IO;
   }
 
-  /* Find an unused entry */
-  while(n < sb.nentries) {
-    result = get_entry_n(&entry, disk, n);
-    if(result >= ERROR_ANY) {
-      return result;
-    }
-    if(!(entry.flags & F_USED)) {
-      return n;
-    }
-    n++;
+  /* Find an unused entry below the high-water mark, or else
+   * the first one past it. write_entry will set it as used */
+  result = bitmap_find(disk, (uint)sb.entrymapstart, 0, (uint)sb.entryhwm, 0);
+  if(result == ERROR_NO_SPACE && sb.entryhwm < sb.nentries) {
+    return (uint)sb.entryhwm;
   }
-
-  return ERROR_NO_SPACE;
+  return result;
 }
 
 /*
- * Get number of needed blocks to contain a given size (bytes)
+ * Get number of needed blocks of bs bytes to contain a given size (bytes)
  */
-static uint needed_blocks(uint size)
+static uint needed_blocks(uint size, uint bs)
 {
-  uint nblocks = size / BLOCK_SIZE;
-  if(size % BLOCK_SIZE) {
+  uint nblocks = size / bs;
+  if(size % bs) {
     nblocks++;
   }
   return nblocks;
 }
 
 /*
- * Find first free block at disk
- * Return its index or ERROR_NOT_FOUND
+ * Check a disk file system can be modified
+ * Returns 0 if it can, or an error code
  */
-static uint find_free_block(uint disk)
+static uint check_writable(uint disk)
 {
   sfs_superblock_t sb;
-  sfs_entry_t entry;
-  uint free_block = 0;
-  uint max_blocks = 0;
-  uint first_data_block = 0;
+
+  /* Read superblock */
+  uint result = get_superblock(disk, &sb);
+  if(result != 0) {
+    return ERROR_IO;
+  }
+
+  /* Only the current revision can be modified */
+  if(sb.type != SFS_TYPE_ID) {
+    debugstr("Disk %x is read only\n\r", disk);
+    return ERROR_IO;
+  }
+
+  return 0;
+}
+
+/*
+ * Allocate a free block at disk
+ * The bitmap is scanned starting after the last allocated block
+ * Return its index or an error code
+ */
+static uint alloc_block(uint disk)
+{
+  sfs_superblock_t sb;
+  uint disk_index = disk_to_index(disk);
+  uint block = 0;
+
+  /* Read superblock */
+  uint result = get_superblock(disk, &sb);
+  if(result != 0) {
+    return ERROR_IO;
+  }
+
+  /* Find a free block and set it as used */
+  block = bitmap_find(disk, (uint)sb.bitmapstart, (uint)sb.bootstart,
+    (uint)sb.size, mount[disk_index].alloc_hint);
+  if(block >= ERROR_ANY) {
+    return block;
+  }
+  result = bitmap_set(disk, (uint)sb.bitmapstart, block, 1);
+  if(result >= ERROR_ANY) {
+    return result;
+  }
+
+  mount[disk_index].alloc_hint = block + 1;
+  return block;
+}
+
+/*
+ * Allocate up to max contiguous free blocks at disk, starting at a given
+ * block. Each bitmap byte is updated once for all its blocks
+ * Returns the number of allocated blocks, 0 if the given block is not free,
+ * or an error code
+ */
+static uint alloc_run(uint disk, uint block, uint max)
+{
+  sfs_superblock_t sb;
+  uint count = 0;
   uint n = 0;
-  uint b = 0;
-  uint found = 0;
+  uchar b = 0;
+  uchar nb = 0;
 
   /* Read superblock */
-  uint result = read_disk(disk, 1, 0, sizeof(sb), (uchar*)&sb);
+  uint result = get_superblock(disk, &sb);
   if(result != 0) {
     return ERROR_IO;
   }
 
-  /* Compute first data block index */
-  first_data_block = 2L +
-    ((uint32_t)sb.nentries*(uint32_t)sizeof(sfs_entry_t))/(uint32_t)BLOCK_SIZE;
+  /* Only data blocks can be allocated */
+  if(block < (uint)sb.bootstart || block >= (uint)sb.size) {
+    return 0;
+  }
+  max = min(max, (uint)sb.size - block);
 
-  /* For each possible block index */
-  max_blocks = sb.size;
-  for(free_block=first_data_block; free_block<max_blocks; free_block++) {
+  while(count < max) {
+    /* Set as used the free blocks of this bitmap byte */
+    n = block + count;
+    result = read_disk(disk, (uint)sb.bitmapstart, n/8, 1, lp(&b));
+    if(result != 0) {
+      return ERROR_IO;
+    }
+    nb = b;
+    while(count < max && (block + count)/8 == n/8 &&
+      !(nb & (1 << ((block + count)%8)))) {
+      nb |= 1 << ((block + count)%8);
+      count++;
+    }
+    if(nb != b) {
+      result = write_disk(disk, (uint)sb.bitmapstart, n/8, 1, lp(&nb));
+      if(result != 0) {
+        return ERROR_IO;
+      }
+    }
 
-    /* Check if there is an entry referencing it */
-    found = 0;
-    n = 0;
-    while(found == 0 && n < sb.nentries) {
-      result = get_entry_n(&entry, disk, n);
-      if(result >= ERROR_ANY) {
-        return result;
+    /* Stop at the first used block */
+    if(count < max && (block + count)/8 == n/8) {
+      break;
+    }
+  }
+
+  if(count) {
+    mount[disk_to_index(disk)].alloc_hint = block + count;
+  }
+  return count;
+}
+
+/*
+ * Set a block as free at disk
+ * Returns 0 on success, or an error code
+ */
+static uint free_block(uint disk, uint block)
+{
+  sfs_superblock_t sb;
+
+  /* Read superblock */
+  uint result = get_superblock(disk, &sb);
+  if(result != 0) {
+    return ERROR_IO;
+  }
+
+  /* Never free blocks outside data blocks */
+  if(block < (uint)sb.bootstart || block >= (uint)sb.size) {
+    debugstr("Free block: bad block (%u)\n\r", block);
+    return ERROR_IO;
+  }
+
+  return bitmap_set(disk, (uint)sb.bitmapstart, block, 0);
+}
+
+/*
+ * Set as free all data blocks of a file entry
+ * Only blocks of this entry are freed, not those of its chained entries
+ * Returns 0 on success, or an error code
+ */
+static uint free_entry_blocks(uint disk, sfs_entry_t* entry)
+{
+  uint result = 0;
+  uint i = 0;
+  uint b = 0;
+
+  if(entry->flags & F_INLINE) {
+    return 0;
+  }
+
+  if(entry->flags & F_EXTENTS) {
+    for(i=0; i<SFS_ENTRYREFS; i+=2) {
+      for(b=0; b<(uint)entry->ref[i+1]; b++) {
+        result = free_block(disk, (uint)entry->ref[i] + b);
+        if(result >= ERROR_ANY) {
+          return result;
+        }
       }
-      if(entry.flags & T_FILE) {
-        for(b=0; b<min(needed_blocks((uint)entry.size), SFS_ENTRYREFS); b++) {
-          if(entry.ref[b] == free_block) {
-            /* If there is, this block is not free */
-            found = 1;
-            break;
-          }
+    }
+  } else {
+    for(i=0; i<min(needed_blocks((uint)entry->size, BLOCK_SIZE),
+      SFS_ENTRYREFS); i++) {
+      if(entry->ref[i]) {
+        result = free_block(disk, (uint)entry->ref[i]);
+        if(result >= ERROR_ANY) {
+          return result;
         }
       }
-      n++;
     }
-    if(found == 0) {
-      /* Otherwise, this is a free block */
-      return free_block;
+  }
+
+  return 0;
+}
+
+/*
+ * Delete chained entries of a file, starting at entry index n
+ * and until the end of the chain, and free their data blocks
+ * Returns 0 on success, or an error code
+ */
+static uint delete_file_chain(uint disk, uint n)
+{
+  sfs_entry_t entry;
+  uint result = 0;
+  uint next = 0;
+
+  while(n != 0) {
+    result = get_entry_n(&entry, disk, n);
+    if(result >= ERROR_ANY) {
+      return result;
+    }
+    result = free_entry_blocks(disk, &entry);
+    if(result >= ERROR_ANY) {
+      return result;
+    }
+    next = (uint)entry.next;
+    memset(&entry, 0, sizeof(entry));
+    result = write_entry(&entry, disk, n);
+    if(result >= ERROR_ANY) {
+      return result;
     }
+    n = next;
   }
 
-  return ERROR_NO_SPACE;
+  return 0;
 }
 
 /*
@@ -751,7 +1895,9 @@ static uint find_free_block(uint disk)
  *
  * Given an initial entry index, this function creates new chained entries
  * or deletes existing ones to fit a given number of total references.
- * Unused or newly created references are set to 0
+ * Unused or newly created references are set to 0. Data blocks no longer
+ * referenced by a file are set as free
+ * Returns the index of the last needed chained entry, or an error code
  */
 static uint set_entry_refcount(uint disk, uint nentry, uint refcount)
 {
@@ -765,14 +1911,18 @@ static uint set_entry_refcount(uint disk, uint nentry, uint refcount)
     nentries += 1;
   }
 
+  /* Open files of this entry could be using a chained entry
+   * which is going to be deleted */
+  files_reset_chain(disk, nentry);
+
   /* Start from the first one */
   result = get_entry_n(&entry, disk, nentry);
   if(result >= ERROR_ANY) {
     return result;
   }
 
-  /* Advance to the last chained entry, create if needed */
-  while(nentries > 0) {
+  /* Advance to the last needed chained entry, create if needed */
+  while(nentries > 1) {
     if(entry.next) {
       nentry = get_entry_n(&entry, disk, (uint)entry.next);
       if(nentry >= ERROR_ANY) {
@@ -801,7 +1951,17 @@ static uint set_entry_refcount(uint disk, uint nentry, uint refcount)
   }
 
   /* Set to 0 unused references of last chained entry */
-  for(i=refcount%SFS_ENTRYREFS; i<SFS_ENTRYREFS; i++) {
+  i = refcount % SFS_ENTRYREFS;
+  if(i == 0 && refcount != 0) {
+    i = SFS_ENTRYREFS;
+  }
+  for(; i<SFS_ENTRYREFS; i++) {
+    if((entry.flags & T_FILE) && entry.ref[i]) {
+      result = free_block(disk, (uint)entry.ref[i]);
+      if(result >= ERROR_ANY) {
+        return result;
+      }
+    }
     entry.ref[i] = 0;
   }
   result = write_entry(&entry, disk, nentry);
@@ -824,6 +1984,14 @@ static uint set_entry_refcount(uint disk, uint nentry, uint refcount)
         return current;
       }
       next = entry.next;
+      for(i=0; i<SFS_ENTRYREFS; i++) {
+        if((entry.flags & T_FILE) && entry.ref[i]) {
+          result = free_block(disk, (uint)entry.ref[i]);
+          if(result >= ERROR_ANY) {
+            return result;
+          }
+        }
+      }
       memset(&entry, 0, sizeof(entry));
       result = write_entry(&entry, disk, current);
       if(result >= ERROR_ANY) {
@@ -832,7 +2000,7 @@ static uint set_entry_refcount(uint disk, uint nentry, uint refcount)
     } while(next);
   }
 
-  return 0;
+  return nentry;
 }
 
 /*
@@ -866,6 +2034,267 @@ static uint set_entry_size(uint disk, uint nentry, uint size)
   return 0;
 }
 
+/*
+ * Set size of a file with extents, and its time to now
+ *
+ * Data blocks are allocated or freed to fit the new size. New blocks are
+ * appended to the last extent while the next disk blocks are free, so files
+ * are kept contiguous. Otherwise a new extent is started, in a new chained
+ * entry if the last one is full. Unneeded chained entries are deleted.
+ * New chained entries are written as soon as they are found, so they
+ * are set as used before looking for the next one.
+ * If blocks or entries can't be allocated, the file keeps its previous
+ * size, and blocks and entries allocated here are freed
+ * Returns 0 on success, or an error code
+ */
+static uint extents_set_size(uint disk, uint nentry, uint size)
+{
+  sfs_entry_t entry;
+  uint bs = disk_block_size(disk);
+  uint nblocks = needed_blocks(size, bs);
+  uint oldsize = 0;
+  uint first = 0; /* Number of blocks before current extent */
+  uint n = nentry;
+  uint used = 0;  /* Number of used extents in current entry */
+  uint keep = 0;
+  uint block = 0;
+  uint result = 0;
+  uint i = 0;
+  uint32_t fstime = 0;
+  time_t ctime;
+
+  /* Get time and convert to fs time */
+  time(&ctime);
+  fstime = fs_systime_to_fstime(&ctime);
+
+  /* Open files of this entry could be using a chained entry
+   * which is going to be deleted */
+  files_reset_chain(disk, nentry);
+
+  result = get_entry_n(&entry, disk, n);
+  if(result >= ERROR_ANY) {
+    return result;
+  }
+  oldsize = (uint)entry.size;
+
+  while(1) {
+    /* Size of chained entries starts at their first block */
+    entry.size = size - first*bs;
+    entry.time = fstime;
+
+    /* Free blocks after the new end */
+    used = 0;
+    for(i=0; i<SFS_ENTRYREFS && entry.ref[i+1]; i+=2) {
+      if(first + (uint)entry.ref[i+1] > nblocks) {
+        keep = first < nblocks ? nblocks - first : 0;
+        for(block=keep; block<(uint)entry.ref[i+1]; block++) {
+          result = free_block(disk, (uint)entry.ref[i] + block);
+          if(result >= ERROR_ANY) {
+            return result;
+          }
+        }
+        entry.ref[i+1] = keep;
+        if(keep == 0) {
+          entry.ref[i] = 0;
+        }
+      }
+      if(entry.ref[i+1]) {
+        used++;
+      }
+      first += (uint)entry.ref[i+1];
+    }
+
+    /* Continue with next chained entry if still needed */
+    if(entry.next == 0 || first >= nblocks) {
+      break;
+    }
+    result = write_entry(&entry, disk, n);
+    if(result >= ERROR_ANY) {
+      return result;
+    }
+    n = (uint)entry.next;
+    result = get_entry_n(&entry, disk, n);
+    if(result >= ERROR_ANY) {
+      return result;
+    }
+  }
+
+  /* Delete remaining chained entries */
+  if(entry.next) {
+    result = delete_file_chain(disk, (uint)entry.next);
+    if(result >= ERROR_ANY) {
+      return result;
+    }
+    entry.next = 0;
+  }
+
+  /* Allocate new blocks */
+  while(first < nblocks) {
+    /* Append as many blocks as possible to the last extent */
+    if(used) {
+      block = alloc_run(disk,
+        (uint)(entry.ref[2*used-2] + entry.ref[2*used-1]), nblocks - first);
+      if(block >= ERROR_ANY) {
+        break;
+      }
+      entry.ref[2*used-1] += block;
+      first += block;
+      if(first >= nblocks) {
+        break;
+      }
+    }
+
+    /* Otherwise start a new extent */
+    /* Create a new chained entry if this one is full */
+    if(2*used == SFS_ENTRYREFS) {
+      block = find_free_entry(disk);
+      if(block >= ERROR_ANY) {
+        break;
+      }
+      entry.next = block;
+      result = write_entry(&entry, disk, n);
+      if(result >= ERROR_ANY) {
+        return result;
+      }
+      entry.parent = n;
+      n = (uint)entry.next;
+      entry.next = 0;
+      entry.size = size - first*bs;
+      memset(entry.ref, 0, sizeof(entry.ref));
+      used = 0;
+      /* Write it now to set it as used, so it's not found again */
+      result = write_entry(&entry, disk, n);
+      if(result >= ERROR_ANY) {
+        return result;
+      }
+    }
+
+    block = alloc_block(disk);
+    if(block >= ERROR_ANY) {
+      break;
+    }
+    entry.ref[2*used] = block;
+    entry.ref[2*used+1] = 1;
+    used++;
+    first++;
+  }
+
+  result = write_entry(&entry, disk, n);
+  if(result >= ERROR_ANY) {
+    return result;
+  }
+
+  /* Allocation failed. Blocks allocated here are referenced by the
+   * written entries, so they are freed restoring the previous size */
+  if(first < nblocks) {
+    result = extents_set_size(disk, nentry, oldsize);
+    return result >= ERROR_ANY ? result : block;
+  }
+
+  return 0;
+}
+
+/* Buffer to move data of inline files, so it's not in the stack */
+static uchar inline_buff[SFS_INLINESIZE];
+
+/*
+ * Set size of a file, and its time to now
+ *
+ * Files up to SFS_INLINESIZE bytes keep their data inline, in the
+ * entry references. Inline files growing beyond that are moved to data
+ * blocks, and files with extents shrinking to fit are moved inline.
+ * SFS_INLINESIZE is smaller than BLOCK_SIZE, so inline data always
+ * fits in the first data block
+ * Returns 0 on success, or an error code
+ */
+static uint file_set_size(uint disk, uint nentry, uint size)
+{
+  sfs_entry_t entry;
+  uint count = 0;
+  uint result = 0;
+  time_t ctime;
+
+  result = get_entry_n(&entry, disk, nentry);
+  if(result >= ERROR_ANY) {
+    return result;
+  }
+
+  /* Inline file which still fits: bytes after size are kept clear */
+  if((entry.flags & F_INLINE) && size <= SFS_INLINESIZE) {
+    if(size < (uint)entry.size) {
+      memset((uchar*)entry.ref + size, 0, (uint)entry.size - size);
+    }
+    time(&ctime);
+    entry.time = fs_systime_to_fstime(&ctime);
+    entry.size = size;
+    return write_entry(&entry, disk, nentry);
+  }
+
+  /* Inline file which does not fit: move data to a block */
+  if(entry.flags & F_INLINE) {
+    count = (uint)entry.size;
+    memcpy(inline_buff, entry.ref, count);
+    entry.flags = T_FILE | F_EXTENTS;
+    entry.size = 0;
+    memset(entry.ref, 0, sizeof(entry.ref));
+    result = write_entry(&entry, disk, nentry);
+    if(result >= ERROR_ANY) {
+      return result;
+    }
+    result = extents_set_size(disk, nentry, size);
+    if(result < ERROR_ANY && count > 0) {
+      result = get_entry_n(&entry, disk, nentry);
+      if(result < ERROR_ANY &&
+        write_disk(disk, (uint)entry.ref[0], 0, count, lp(inline_buff)) != 0) {
+        result = ERROR_IO;
+      }
+    }
+    if(result < ERROR_ANY) {
+      return 0;
+    }
+
+    /* Failed: free blocks and restore inline data */
+    extents_set_size(disk, nentry, 0);
+    if(get_entry_n(&entry, disk, nentry) < ERROR_ANY) {
+      entry.flags = T_FILE | F_INLINE;
+      entry.size = count;
+      memset(entry.ref, 0, sizeof(entry.ref));
+      memcpy(entry.ref, inline_buff, count);
+      write_entry(&entry, disk, nentry);
+    }
+    return result;
+  }
+
+  /* File with extents which now fits: move data inline */
+  if((entry.flags & F_EXTENTS) && size <= SFS_INLINESIZE) {
+    count = min(size, (uint)entry.size);
+    if(count > 0 &&
+      read_disk(disk, (uint)entry.ref[0], 0, count, lp(inline_buff)) != 0) {
+      return ERROR_IO;
+    }
+    result = extents_set_size(disk, nentry, 0);
+    if(result >= ERROR_ANY) {
+      return result;
+    }
+    result = get_entry_n(&entry, disk, nentry);
+    if(result >= ERROR_ANY) {
+      return result;
+    }
+    entry.flags = T_FILE | F_INLINE;
+    entry.size = size;
+    memset(entry.ref, 0, sizeof(entry.ref));
+    memcpy(entry.ref, inline_buff, count);
+    return write_entry(&entry, disk, nentry);
+  }
+
+  if(!(entry.flags & F_EXTENTS)) {
+    debugstr("Set file size: file has no extents (%u)\n\r", nentry);
+    return ERROR_IO;
+  }
+
+  return extents_set_size(disk, nentry, size);
+}
+
 /*
  * Given an entry, return its refcount
  */
@@ -873,7 +2302,7 @@ static uint get_entry_refcount(sfs_entry_t* entry)
 {
   uint refcount = 0;
   if(entry->flags & T_FILE) {
-    refcount = needed_blocks((uint)entry->size);
+    refcount = needed_blocks((uint)entry->size, BLOCK_SIZE);
   } else if(entry->flags & T_DIR) {
     refcount = entry->size;
   }
@@ -884,8 +2313,9 @@ static uint get_entry_refcount(sfs_entry_t* entry)
 /*
  * Add a reference in an entry
  * Advances throguh the chain if needed
+ * References in directories must be built with dir_ref
  */
-static uint add_ref_in_entry(uint disk, uint nentry, uint ref)
+static uint add_ref_in_entry(uint disk, uint nentry, ul_t ref)
 {
   sfs_entry_t entry;
   sfs_entry_t refentry;
@@ -941,6 +2371,7 @@ static uint add_ref_in_entry(uint disk, uint nentry, uint ref)
 /*
  * Remove a reference in an entry
  * Updates size and chain length if needed
+ * In directories, ref is the entry index, whatever its name hash
  */
 static uint remove_ref_in_entry(uint disk, uint nentry, uint ref)
 {
@@ -989,7 +2420,8 @@ static uint remove_ref_in_entry(uint disk, uint nentry, uint ref)
       }
     }
 
-    if(!found && currentry.ref[r] == ref) {
+    if(!found && ((entry.flags & T_DIR) ?
+      SFS_REFENTRY(currentry.ref[r]) : (uint)currentry.ref[r]) == ref) {
       found = 1;
     }
     if(found) {
@@ -1018,166 +2450,399 @@ static uint remove_ref_in_entry(uint disk, uint nentry, uint ref)
   return 0;
 }
 
+/*
+ * Open a file given its path
+ * If flags contains WF_CREATE, the file is created if it does not exist
+ * Fills f, with position 0
+ * Returns the file entry index or an error code
+ */
+static uint file_open(sfs_file_t* f, uchar* path, uint flags)
+{
+  sfs_entry_t entry;
+  uint disk = 0;
+  uint nentry = 0;
+  uint result = 0;
+
+  /* Find file */
+  disk = path_get_disk(path);
+  nentry = fs_get_entry(&entry, path, UNKNOWN_VALUE, UNKNOWN_VALUE);
+
+  /* Does not exist and should not create or it's a directory: return */
+  if((nentry == ERROR_NOT_FOUND && !(flags & WF_CREATE)) ||
+    (nentry >= ERROR_ANY && nentry != ERROR_NOT_FOUND)) {
+    return nentry;
+  }
+  if(nentry < ERROR_ANY && (entry.flags & T_DIR)) {
+    return ERROR_NOT_FOUND;
+  }
+
+  /* Create file if needed */
+  if(nentry == ERROR_NOT_FOUND && (flags & WF_CREATE)) {
+    uint parent = 0;
+    memset(&entry, 0, sizeof(entry));
+
+    result = check_writable(disk);
+    if(result >= ERROR_ANY) {
+      return result;
+    }
+
+    /* Parse parent, disk and name */
+    result = path_parse_disk_parent_name(&path, &parent, &disk, path);
+    if(result >= ERROR_ANY) {
+      return result;
+    }
+
+    /* Make name a valid name */
+    path = string_to_name(path);
+
+    /* Fill entry data */
+    nentry = find_free_entry(disk);
+    if(nentry >= ERROR_ANY) {
+      return nentry;
+    }
+    entry.size = 0;
+    entry.next = 0;
+    entry.parent = parent;
+    entry.flags = T_FILE | F_INLINE;
+    strcpy_s(entry.name, path, SFS_NAMESIZE);
+    result = write_entry(&entry, disk, nentry);
+    if(result >= ERROR_ANY) {
+      return result;
+    }
+    dentry_drop_name(disk, parent, path);
+
+    /* Add reference in parent */
+    result = add_ref_in_entry(disk, (uint)entry.parent,
+      dir_ref(nentry, entry.name));
+    if(result >= ERROR_ANY) {
+      return result;
+    }
+  }
+
+  f->disk = disk;
+  f->nentry = nentry;
+  f->position = 0;
+  f->nchain = 0;
+
+  return nentry;
+}
+
+/*
+ * Write count bytes of buff to a file, starting at its position
+ * The file grows if needed. If flags contains WF_TRUNCATE,
+ * it's also truncated after the last written byte
+ * Returns number of written bytes or an error code
+ */
+static uint file_write(sfs_file_t* f, lp_t buff, uint count, uint flags)
+{
+  uint disk = f->disk;
+  uint nentry = f->nentry;
+  sfs_entry_t entry;
+  uint written = 0;
+  uint first = 0;
+  uint result = 0;
+  uint bs = disk_block_size(disk);
+
+  /* Get head entry */
+  result = get_entry_n(&entry, disk, nentry);
+  if(result >= ERROR_ANY) {
+    return result;
+  }
+
+  /* Resize if needed. This also updates time */
+  if(entry.size < f->position + count ||
+    (entry.size > f->position + count && (flags & WF_TRUNCATE))) {
+    result = file_set_size(disk, nentry, f->position + count);
+    if(result >= ERROR_ANY) {
+      return result;
+    }
+    f->nchain = 0;
+  } else {
+    result = set_entry_time_to_current(disk, nentry);
+    if(result >= ERROR_ANY) {
+      return result;
+    }
+  }
+
+  /* Now file has the right size: write data */
+  written = 0;
+  while(count > 0) {
+    uint offset = f->position % bs;
+    uint current_block = f->position / bs;
+    uint run = 0;
+    uint to_copy = 0;
+
+    /* Get chained entry for current position */
+    if(written == 0 || current_block >= first + entry_nblocks(&entry)) {
+      result = file_get_entry(f, &entry, current_block, &first);
+      if(result >= ERROR_ANY) {
+        return result;
+      }
+    }
+
+    /* Inline data is written in the entry itself */
+    if(entry.flags & F_INLINE) {
+      lmem_copy(lp((uchar*)entry.ref + f->position), buff + written, count);
+      result = write_entry(&entry, disk, nentry);
+      if(result >= ERROR_ANY) {
+        return result;
+      }
+      f->position += count;
+      written += count;
+      break;
+    }
+
+    /* Write all contiguous blocks at once */
+    current_block = entry_get_block(&entry, current_block - first, &run);
+    if(current_block == 0) {
+      return ERROR_IO;
+    }
+    to_copy = (uint)min((ul_t)run*bs - offset, (ul_t)count);
+    result = write_disk(disk, current_block, offset, to_copy, buff + written);
+    if(result != 0) {
+      return ERROR_IO;
+    }
+    count -= to_copy;
+    f->position += to_copy;
+    written += to_copy;
+  }
+
+  return written;
+}
+
+/*
+ * Read file in buff, given path, offset and count
+ */
+uint fs_read_file(lp_t buff, uchar* path, uint offset, uint count)
+{
+  sfs_file_t f;
+
+  /* Find file */
+  uint result = file_open(&f, path, 0);
+  if(result >= ERROR_ANY) {
+    return result;
+  }
+
+  /* Read */
+  f.position = offset;
+  return file_read(&f, buff, count);
+}
+
 /*
  * Write buff to file given path, offset, count and flags
  */
-uint fs_write_file(uchar* buff, uchar* path, uint offset, uint count, uint flags)
+uint fs_write_file(lp_t buff, uchar* path, uint offset, uint count, uint flags)
 {
-  uint disk = 0;
-  uint nentry = 0;
-  sfs_entry_t entry;
-  sfs_entry_t tentry;
-  uint written = 0;
-  uint result = 0;
-
-  /* Find file */
-  disk = path_get_disk(path);
-  nentry = fs_get_entry(&entry, path, UNKNOWN_VALUE, UNKNOWN_VALUE);
+  sfs_file_t f;
 
-  /* Does not exist and should not create or it's a directory: return */
-  if((nentry == ERROR_NOT_FOUND && !(flags & WF_CREATE)) ||
-    (nentry >= ERROR_ANY && nentry != ERROR_NOT_FOUND)) {
-    return nentry;
-  }
-  if(nentry < ERROR_ANY && (entry.flags & T_DIR)) {
-    return ERROR_NOT_FOUND;
+  /* Check disk */
+  uint result = check_writable(path_get_disk(path));
+  if(result >= ERROR_ANY) {
+    return result;
   }
 
-  /* Create file if needed */
-  if(nentry == ERROR_NOT_FOUND && (flags & WF_CREATE)) {
-    uint parent = 0;
-    memset(&entry, 0, sizeof(entry));
+  /* Find or create file */
+  result = file_open(&f, path, flags);
+  if(result >= ERROR_ANY) {
+    return result;
+  }
 
-    /* Parse parent, disk and name */
-    result = path_parse_disk_parent_name(&path, &parent, &disk, path);
-    if(result >= ERROR_ANY) {
-      return result;
-    }
+  /* Write */
+  f.position = offset;
+  return file_write(&f, buff, count, flags);
+}
 
-    /* Make name a valid name */
-    path = string_to_name(path);
+/*
+ * Open file
+ */
+uint fs_open(uchar* path, uint flags)
+{
+  sfs_file_t f;
+  uint handle = 0;
+  uint result = 0;
 
-    /* Fill entry data */
-    nentry = find_free_entry(disk);
-    if(nentry >= ERROR_ANY) {
-      return nentry;
-    }
-    entry.size = 0;
-    entry.next = 0;
-    entry.parent = parent;
-    entry.flags = T_FILE;
-    strcpy_s(entry.name, path, SFS_NAMESIZE);
-    result = write_entry(&entry, disk, nentry);
-    if(result >= ERROR_ANY) {
-      return result;
+  /* Find an unused handle */
+  for(handle=0; handle<FS_MAX_FILES; handle++) {
+    if(open_files[handle].nentry == 0) {
+      break;
     }
+  }
+  if(handle >= FS_MAX_FILES) {
+    return ERROR_NO_SPACE;
+  }
 
-    /* Add reference in parent */
-    result = add_ref_in_entry(disk, (uint)entry.parent, nentry);
+  /* Check disk if it's going to be modified */
+  if(flags & (WF_CREATE | WF_TRUNCATE)) {
+    result = check_writable(path_get_disk(path));
     if(result >= ERROR_ANY) {
       return result;
     }
   }
 
-  /* Resize: grow if needed */
-  if(entry.size < offset + count) {
-    uint current_block = needed_blocks((uint)entry.size);
-    uint final_block = needed_blocks(offset + count);
-    uint ntentry = 0;
+  /* Find or create file */
+  result = file_open(&f, path, flags);
+  if(result >= ERROR_ANY) {
+    return result;
+  }
 
-    /* Set reference count and size in the chain */
-    result = set_entry_refcount(disk, nentry, final_block);
-    if(result >= ERROR_ANY) {
-      return result;
-    }
-    result = set_entry_size(disk, nentry, offset + count);
+  /* Truncate if requested */
+  if(flags & WF_TRUNCATE) {
+    result = file_write(&f, 0, 0, WF_TRUNCATE);
     if(result >= ERROR_ANY) {
       return result;
     }
+  }
 
-    /* Allocate blocks */
-    result = get_entry_n(&tentry, disk, nentry);
-    if(result >= ERROR_ANY) {
-      return result;
-    }
-    ntentry = nentry;
+  memcpy(&open_files[handle], &f, sizeof(f));
+  return handle;
+}
 
-    for(; current_block < final_block; current_block++) {
-      while(current_block > SFS_ENTRYREFS) {
-        result = write_entry(&tentry, disk, ntentry);
-        if(result >= ERROR_ANY) {
-          return result;
-        }
-        ntentry = get_entry_n(&tentry, disk, (uint)tentry.next);
-        if(ntentry >= ERROR_ANY) {
-          return ntentry;
-        }
-        current_block -= SFS_ENTRYREFS;
-        final_block -= SFS_ENTRYREFS;
-      }
-      tentry.ref[current_block] = find_free_block(disk);
-      if(tentry.ref[current_block] >= ERROR_ANY) {
-        return tentry.ref[current_block];
-      }
-    }
-    result = write_entry(&tentry, disk, ntentry);
-    if(result >= ERROR_ANY) {
-      return result;
-    }
-    result = get_entry_n(&entry, disk, nentry);
-    if(result >= ERROR_ANY) {
-      return result;
-    }
+/*
+ * Read from open file
+ */
+uint fs_read(uint handle, lp_t buff, uint count)
+{
+  if(handle >= FS_MAX_FILES || open_files[handle].nentry == 0) {
+    return ERROR_NOT_FOUND;
   }
+  return file_read(&open_files[handle], buff, count);
+}
 
-  /* Resize: shrink if needed */
-  if(entry.size > offset + count && (flags & WF_TRUNCATE)) {
-    uint nblocks = needed_blocks(offset + count);
-    result = set_entry_refcount(disk, nentry);
-    if(result >= ERROR_ANY) {
-      return result;
-    }
-    result = set_entry_size(disk, nentry, offset + count);
-    if(result >= ERROR_ANY) {
-      return result;
-    }
-    result = get_entry_n(&entry, disk, nentry);
-    if(result >= ERROR_ANY) {
-      return result;
-    }
+/*
+ * Read from open file asynchronously
+ */
+uint fs_read_async(uint handle, lp_t buff, uint count, lp_t done)
+{
+  sfs_file_t* f = 0;
+  ata_request_t* req = 0;
+  sfs_entry_t entry;
+  uint ata = 0;
+  uint first = 0;
+  uint block = 0;
+  uint offset = 0;
+  uint run = 0;
+  uint size = 0;
+  uint max = 0;
+  uint n = 0;
+  uint result = 0;
+  uint bs = 0;
+  ul_t sector = 0;
+
+  if(handle >= FS_MAX_FILES || open_files[handle].nentry == 0) {
+    return ERROR_NOT_FOUND;
   }
+  f = &open_files[handle];
+  req = &file_requests[handle];
+  bs = disk_block_size(f->disk);
 
-  /* Now file has the right size: write data */
-  written = 0;
-  while(count > 0) {
-    uint to_copy = min(count, BLOCK_SIZE - (offset % BLOCK_SIZE));
-    uint current_block = needed_blocks(offset + to_copy) - 1;
-    while(current_block > SFS_ENTRYREFS) {
-      result = get_entry_n(&entry, disk, (uint)entry.next);
-      if(result >= ERROR_ANY) {
-        return result;
-      }
-      offset -= SFS_ENTRYREFS*BLOCK_SIZE;
-      current_block -= SFS_ENTRYREFS;
+  /* Only one request per file */
+  if(req->pending) {
+    ata_wait_request(req);
+  }
+
+  /* Find data blocks at current position */
+  result = file_get_entry(f, &entry, f->position / bs, &first);
+  if(result >= ERROR_ANY && result != ERROR_NOT_FOUND) {
+    return result;
+  }
+  size = (uint)entry.size + first*bs;
+  if(result == ERROR_NOT_FOUND || f->position >= size) {
+    count = 0;
+  }
+  count = min(count, size - f->position);
+
+  /* Whole sectors of contiguous blocks which are not cached
+   * are read asynchronously, if the disk supports it */
+  ata = disk_info[disk_to_index(f->disk)].ata;
+  if(ata != 0 && count >= SECTOR_SIZE && f->position % SECTOR_SIZE == 0) {
+    offset = f->position % bs;
+    block = entry_get_block(&entry, f->position / bs - first, &run);
+    sector = ((ul_t)block * bs + offset) / SECTOR_SIZE;
+    max = (uint)min(((ul_t)run * bs - offset) / SECTOR_SIZE,
+      (ul_t)min(count / SECTOR_SIZE, DISK_MAX_SECTORS));
+    while(block != 0 && n < max &&
+      dcache_find(f->disk, sector + n) == ERROR_NOT_FOUND) {
+      n++;
     }
+  }
 
-    result = write_disk(disk, (uint)entry.ref[current_block],
-      offset%BLOCK_SIZE, to_copy, &buff[written]);
-    if(result != 0) {
-      return result;
+  if(n > 0) {
+    req->dev = ata;
+    req->sector = sector;
+    req->n = n;
+    req->buff = buff;
+    req->write = 0;
+    req->done = done;
+    if(ata_submit(req) == 0) {
+      f->position += n * SECTOR_SIZE;
+      return n * SECTOR_SIZE;
     }
-    count -= to_copy;
-    offset += to_copy;
-    written += to_copy;
   }
 
-  /* Update file entry time */
-  result = set_entry_time_to_current(disk, nentry);
+  /* Otherwise, read synchronously */
+  result = file_read(f, buff, count);
+  if(done != 0) {
+    n = result < ERROR_ANY ? 1 : result;
+    lmem_copy(done, lp(&n), sizeof(n));
+  }
+  return result;
+}
+
+/*
+ * Write to open file
+ */
+uint fs_write(uint handle, lp_t buff, uint count)
+{
+  uint result = 0;
+  if(handle >= FS_MAX_FILES || open_files[handle].nentry == 0) {
+    return ERROR_NOT_FOUND;
+  }
+  result = check_writable(open_files[handle].disk);
   if(result >= ERROR_ANY) {
     return result;
   }
+  return file_write(&open_files[handle], buff, count, 0);
+}
 
-  return written;
+/*
+ * Set position of open file
+ */
+uint fs_seek(uint handle, uint offset)
+{
+  if(handle >= FS_MAX_FILES || open_files[handle].nentry == 0) {
+    return ERROR_NOT_FOUND;
+  }
+  open_files[handle].position = offset;
+  return offset;
+}
+
+/*
+ * Close open file
+ */
+uint fs_close(uint handle)
+{
+  if(handle >= FS_MAX_FILES || open_files[handle].nentry == 0) {
+    return ERROR_NOT_FOUND;
+  }
+  if(file_requests[handle].pending) {
+    ata_wait_request(&file_requests[handle]);
+  }
+  open_files[handle].nentry = 0;
+  return 0;
+}
+
+/*
+ * Close all open files
+ */
+void fs_close_all()
+{
+  uint i = 0;
+  for(i=0; i<FS_MAX_FILES; i++) {
+    if(file_requests[i].pending) {
+      ata_wait_request(&file_requests[i]);
+    }
+  }
+  memset(open_files, 0, sizeof(open_files));
 }
 
 /*
@@ -1203,7 +2868,7 @@ static uint delete_n(uint disk, uint n)
   if(entry.flags & T_DIR) {
     uint b = 0;
     while(b < min(entry.size, SFS_ENTRYREFS)) {
-      result = delete_n(disk, (uint)entry.ref[b]);
+      result = delete_n(disk, SFS_REFENTRY(entry.ref[b]));
       if(result >= ERROR_ANY) {
         return result;
       }
@@ -1211,6 +2876,21 @@ static uint delete_n(uint disk, uint n)
     }
   }
 
+  /* Set as free all blocks of this entry if it's a file.
+   * Chained entries of files are deleted here too, because
+   * they are not referenced by a directory */
+  if(entry.flags & T_FILE) {
+    result = free_entry_blocks(disk, &entry);
+    if(result >= ERROR_ANY) {
+      return result;
+    }
+    result = delete_file_chain(disk, (uint)entry.next);
+    if(result >= ERROR_ANY) {
+      return result;
+    }
+    entry.next = 0;
+  }
+
   /* Delete full chain */
   if(entry.next) {
     result = delete_n(disk, (uint)entry.next);
@@ -1224,6 +2904,8 @@ static uint delete_n(uint disk, uint n)
   if(result >= ERROR_ANY) {
     return result;
   }
+  dentry_drop_entry(disk, n);
+  files_close(disk, n);
 
   return 0;
 }
@@ -1235,10 +2917,15 @@ uint fs_delete(uchar* path)
 {
   uint disk = 0;
   uint nentry = 0;
+  uint result = 0;
   sfs_entry_t entry;
 
   /* Find entry, and delete by index */
   disk = path_get_disk(path);
+  result = check_writable(disk);
+  if(result >= ERROR_ANY) {
+    return result;
+  }
   nentry = fs_get_entry(&entry, path, UNKNOWN_VALUE, UNKNOWN_VALUE);
   if(nentry < ERROR_ANY) {
     nentry = delete_n(disk, nentry);
@@ -1262,6 +2949,10 @@ uint fs_create_directory(uchar* path)
   if(result >= ERROR_ANY) {
     return result;
   }
+  result = check_writable(disk);
+  if(result >= ERROR_ANY) {
+    return result;
+  }
 
   /* Make name a valid name */
   path = string_to_name(path);
@@ -1292,6 +2983,7 @@ uint fs_create_directory(uchar* path)
   if(result >= ERROR_ANY) {
     return result;
   }
+  dentry_drop_name(disk, parent, path);
 
   /* Update modified time */
   result = set_entry_time_to_current(disk, nentry);
@@ -1301,7 +2993,8 @@ uint fs_create_directory(uchar* path)
 
   /* Add reference in parent */
   if(nentry != entry.parent) {
-    result = add_ref_in_entry(disk, (uint)entry.parent, nentry);
+    result = add_ref_in_entry(disk, (uint)entry.parent,
+      dir_ref(nentry, entry.name));
     if(result >= ERROR_ANY) {
       return result;
     }
@@ -1348,6 +3041,16 @@ uint fs_move(uchar* srcpath, uchar* dstpath)
     return nentry;
   }
 
+  /* Both disks will be modified */
+  result = check_writable(srcdisk);
+  if(result >= ERROR_ANY) {
+    return result;
+  }
+  result = check_writable(dstdisk);
+  if(result >= ERROR_ANY) {
+    return result;
+  }
+
   /* If moving between disks, physically move data: copy and delete */
   if(srcdisk != dstdisk) {
     result = fs_copy(srcpath, dstpath);
@@ -1373,9 +3076,12 @@ uint fs_move(uchar* srcpath, uchar* dstpath)
     if(result >= ERROR_ANY) {
       return result;
     }
+    dentry_drop_entry(dstdisk, nentry);
+    dentry_drop_name(dstdisk, dst_parent, dstname);
 
     /* Add reference in parent */
-    result = add_ref_in_entry(dstdisk, (uint)entry.parent, nentry);
+    result = add_ref_in_entry(dstdisk, (uint)entry.parent,
+      dir_ref(nentry, entry.name));
     if(result >= ERROR_ANY) {
       return result;
     }
@@ -1384,6 +3090,10 @@ uint fs_move(uchar* srcpath, uchar* dstpath)
   return nentry;
 }
 
+/* Buffer to copy files. Big enough to transfer many blocks at once,
+ * so it's not in the stack */
+static uchar copy_buff[8*BLOCK_SIZE];
+
 /*
  * Copy entry
  */
@@ -1424,19 +3134,31 @@ uint fs_copy(uchar* srcpath, uchar* dstpath)
 
   /* If source is a file, just read and write the full file */
   if(entry.flags & T_FILE) {
-    uint offset = 0;
+    sfs_file_t src;
+    sfs_file_t dst;
     uint copied = 0;
-    uchar buff[BLOCK_SIZE];
 
-    while(copied = fs_read_file(buff, srcpath, offset, sizeof(buff))) {
+    result = check_writable(path_get_disk(dstpath));
+    if(result >= ERROR_ANY) {
+      return result;
+    }
+    result = file_open(&src, srcpath, 0);
+    if(result >= ERROR_ANY) {
+      return result;
+    }
+    result = file_open(&dst, dstpath, WF_CREATE);
+    if(result >= ERROR_ANY) {
+      return result;
+    }
+
+    while(copied = file_read(&src, lp(copy_buff), sizeof(copy_buff))) {
       if(copied >= ERROR_ANY) {
         return copied;
       }
-      result = fs_write_file(buff, dstpath, offset, copied, WF_CREATE);
+      result = file_write(&dst, lp(copy_buff), copied, 0);
       if(result >= ERROR_ANY) {
         return result;
       }
-      offset += copied;
     }
     return 0;
   }
@@ -1455,7 +3177,7 @@ uint fs_copy(uchar* srcpath, uchar* dstpath)
       sfs_entry_t tentry;
       uchar src_path[64];
       uchar dst_path[64];
-      result = get_entry_n(&tentry, src_disk, (uint)entry.ref[r]);
+      result = get_entry_n(&tentry, src_disk, SFS_REFENTRY(entry.ref[r]));
       if(result >= ERROR_ANY) {
         return result;
       }
@@ -1506,7 +3228,7 @@ uint fs_list(sfs_entry_t* entry, uchar* path, uint n)
         return res;
       }
       /* Get the entry */
-      res = get_entry_n(entry, disk, (uint)direntry.ref[n]);
+      res = get_entry_n(entry, disk, SFS_REFENTRY(direntry.ref[n]));
       if(res >= ERROR_ANY) {
         return res;
       }
@@ -1516,6 +3238,86 @@ uint fs_list(sfs_entry_t* entry, uchar* path, uint n)
   return ERROR_NOT_FOUND;
 }
 
+/*
+ * Read directory entries
+ */
+uint fs_readdir(lp_t entries, uint n, uchar* path, uint* cookie)
+{
+  uint nentry = 0;
+  uint disk = 0;
+  uint count = 0;
+  uint nref = 0;
+  uint nitems = 0;
+  uint result = 0;
+  uint i = 0;
+  sfs_entry_t direntry;
+  sfs_entry_t entry;
+  fs_entry_t o_entry;
+
+  /* Find directory */
+  disk = path_get_disk(path);
+  nentry = fs_get_entry(&direntry, path, UNKNOWN_VALUE, UNKNOWN_VALUE);
+  if(nentry >= ERROR_ANY) {
+    return nentry;
+  }
+  if(!(direntry.flags & T_DIR)) {
+    return ERROR_NOT_FOUND;
+  }
+
+  nitems = (uint)direntry.size;
+  nref = *cookie;
+  if(nref >= nitems) {
+    return 0;
+  }
+
+  /* Advance to the chained entry containing the first reference */
+  for(i=0; i<nref/SFS_ENTRYREFS; i++) {
+    if(!direntry.next) {
+      return ERROR_NOT_FOUND;
+    }
+    nentry = get_entry_n(&direntry, disk, (uint)direntry.next);
+    if(nentry >= ERROR_ANY) {
+      return nentry;
+    }
+  }
+
+  /* Read referenced entries, following the chain */
+  while(count < n && nref < nitems) {
+    if(count > 0 && nref % SFS_ENTRYREFS == 0) {
+      if(!direntry.next) {
+        return ERROR_NOT_FOUND;
+      }
+      nentry = get_entry_n(&direntry, disk, (uint)direntry.next);
+      if(nentry >= ERROR_ANY) {
+        return nentry;
+      }
+    }
+
+    result = get_entry_n(&entry, disk,
+      SFS_REFENTRY(direntry.ref[nref % SFS_ENTRYREFS]));
+    if(result >= ERROR_ANY) {
+      return result;
+    }
+
+    memset(&o_entry, 0, sizeof(o_entry));
+    strcpy_s(o_entry.name, entry.name, sizeof(o_entry.name));
+    o_entry.flags = entry.flags;
+    o_entry.size = entry.size;
+    o_entry.time = entry.time;
+    lmem_copy(entries + (ul_t)count * sizeof(o_entry), lp(&o_entry),
+      sizeof(o_entry));
+
+    count++;
+    nref++;
+  }
+
+  *cookie = nref;
+  return count;
+}
+
+/* Block size of formatted hard disks. Floppy disks use BLOCK_SIZE */
+#define FORMAT_HD_BLOCK_SIZE 4096
+
 /*
  * Format a disk
  */
@@ -1526,52 +3328,106 @@ uint fs_format(uint disk)
   uchar buff[BLOCK_SIZE];
   sfs_entry_t* entry;
   sfs_superblock_t* sb;
-  uint nentries = 0;
   uint result = 0;
   uint offset = 0;
   uint e = 0;
+  uint bs = BLOCK_SIZE;
+  uint pieces = 0;
   uint32_t disk_size = 0;
+  uint32_t bitmapstart = 0;
+  uint32_t bitmapblocks = 0;
+  uint32_t entrymapstart = 0;
+  uint32_t entrymapblocks = 0;
+  uint32_t first_data_block = 0;
   uint disk_index = disk_to_index(disk);
 
   debugstr("format disk: %x (system_disk=%x)\n\r", disk, system_disk);
 
-  /* Copy boot block from system disk to target disk */
-  result = read_disk(system_disk, 0, 0, BLOCK_SIZE, buff);
+  /* Cached lookups and open files will not be valid anymore */
+  dentry_drop_disk(disk);
+  files_close(disk, UNKNOWN_VALUE);
+
+  /* Copy boot sector from system disk to target disk */
+  result = read_disk(system_disk, 0, 0, SECTOR_SIZE, lp(buff));
   if(result != 0) {
     return ERROR_IO;
   }
 
-  result = write_disk(disk, 0, 0, BLOCK_SIZE, buff);
+  result = write_disk(disk, 0, 0, SECTOR_SIZE, lp(buff));
   if(result != 0) {
     return ERROR_IO;
   }
 
-  /* Create superblock */
+  /* Create superblock. Hard disks have BIOS ids from 0x80 */
+  if(disk >= 0x80) {
+    bs = FORMAT_HD_BLOCK_SIZE;
+  }
   disk_size = (uint32_t)disk_info[disk_index].sectors *
     (uint32_t)disk_info[disk_index].sides *
     (uint32_t)disk_info[disk_index].cylinders;
-
-  if(SECTOR_SIZE > BLOCK_SIZE) {
-    disk_size *= (uint32_t)(SECTOR_SIZE/BLOCK_SIZE);
-  } else {
-    disk_size /= (uint32_t)(BLOCK_SIZE/SECTOR_SIZE);
-  }
+  disk_size /= (uint32_t)(bs/SECTOR_SIZE);
+  disk_size = min(disk_size, SFS_MAXBLOCKS);
 
   memset(buff, 0, sizeof(buff));
   sb = (sfs_superblock_t*)buff;
   sb->type = SFS_TYPE_ID;
   sb->size = disk_size;
+  sb->blocksize = bs;
   sb->nentries = min(
-    (uint32_t)(((sb->size * (uint32_t)BLOCK_SIZE)/10L)/(uint32_t)sizeof(sfs_entry_t)),
-    1024L);
-  sb->bootstart = 2L + (sb->nentries * (uint32_t)sizeof(sfs_entry_t)) / (uint32_t)BLOCK_SIZE;
-  result = write_disk(disk, 1, 0, BLOCK_SIZE, sb);
+    (sb->size/10L) * (uint32_t)(bs/sizeof(sfs_entry_t)), 1024L);
+  sb->bitmapstart = SFS_ENTRIESSTART(bs) +
+    (sb->nentries * (uint32_t)sizeof(sfs_entry_t) + bs - 1) / (uint32_t)bs;
+  sb->bitmapblocks = (sb->size + SFS_BITMAPBITS(bs) - 1) / SFS_BITMAPBITS(bs);
+  sb->entrymapstart = sb->bitmapstart + sb->bitmapblocks;
+  sb->entrymapblocks =
+    (sb->nentries + SFS_BITMAPBITS(bs) - 1) / SFS_BITMAPBITS(bs);
+  sb->bootstart = sb->entrymapstart + sb->entrymapblocks;
+  sb->entryhwm = 0; /* The entries table is not cleared */
+  result = write_disk(disk, 0, SECTOR_SIZE, SECTOR_SIZE, lp(sb));
+  if(result != 0) {
+    return ERROR_IO;
+  }
+  mount_drop(disk);
+  result = get_superblock(disk, sb);
   if(result != 0) {
     return ERROR_IO;
   }
-  debugstr("format: %x blocks=%U entries=%U boot=%U\n\r", disk, sb->size, sb->nentries, sb->bootstart);
+  debugstr("format: %x blocks=%U bs=%u entries=%U boot=%U\n\r", disk, sb->size, bs, sb->nentries, sb->bootstart);
+
+  bitmapstart = sb->bitmapstart;
+  bitmapblocks = sb->bitmapblocks;
+  entrymapstart = sb->entrymapstart;
+  entrymapblocks = sb->entrymapblocks;
+  first_data_block = sb->bootstart;
+
+  /* Bitmaps are written in pieces of sizeof(buff) bytes */
+  pieces = bs / sizeof(buff);
+
+  /* Create blocks bitmap: all blocks before data blocks are used */
+  for(e=0; e<(uint)bitmapblocks*pieces; e++) {
+    memset(buff, 0, sizeof(buff));
+    for(offset=0; offset<sizeof(buff)*8; offset++) {
+      if((uint32_t)e*sizeof(buff)*8 + offset < first_data_block) {
+        buff[offset/8] |= (1 << (offset%8));
+      }
+    }
+    result = write_disk(disk, (uint)bitmapstart + e/pieces,
+      (e%pieces)*sizeof(buff), sizeof(buff), lp(buff));
+    if(result != 0) {
+      return ERROR_IO;
+    }
+  }
 
-  nentries = (uint)sb->nentries;
+  /* Create entries bitmap: all entries are free.
+   * write_entry sets them as used */
+  memset(buff, 0, sizeof(buff));
+  for(e=0; e<(uint)entrymapblocks*pieces; e++) {
+    result = write_disk(disk, (uint)entrymapstart + e/pieces,
+      (e%pieces)*sizeof(buff), sizeof(buff), lp(buff));
+    if(result != 0) {
+      return ERROR_IO;
+    }
+  }
 
   /* Create root dir */
   memset(buff, 0, sizeof(buff));
@@ -1593,12 +3449,6 @@ uint fs_format(uint disk)
     return result;
   }
 
-  /* Write empty entries table */
-  memset(buff, 0, sizeof(buff));
-  for(e=1; e<nentries; e++) {
-    write_entry(entry, disk, e);
-  }
-
   /* Copy boot program */
   result = get_entry_n(entry, system_disk, 1);
   if(result >= ERROR_ANY) {
@@ -11,46 +11,103 @@
 
 /* The file system divides disk space into logical blocks of contiguous space.
  * The size of blocks need not be the same size as the sector size of the disk
- * the file system resides on */
-#define BLOCK_SIZE 512  /* block size in bytes */
-/* With the current implementation, BLOCK_SIZE must be a power of 2 */
+ * the file system resides on. Each disk has its own block size, stored in
+ * the superblock, from BLOCK_SIZE to SFS_MAXBLOCKSIZE bytes */
+#define BLOCK_SIZE        512  /* Min and default block size in bytes */
+#define SFS_MAXBLOCKSIZE 4096  /* Max block size in bytes */
+/* With the current implementation, block size must be a power of 2 */
+/* Block numbers are handled as 16 bit values, and values from ERROR_ANY
+ * are error codes, so file systems are limited to SFS_MAXBLOCKS blocks.
+ * Bigger disks are formatted to this size */
+#define SFS_MAXBLOCKS 0xFFFBL  /* ERROR_ANY */
 
 /* Disk layout: */
-/* [boot block | super block | entries table | data blocks] */
+/* [boot block | super block | entries table | blocks bitmap | entries bitmap | data blocks] */
 
 /* Boot block    block 0           Boot sector */
-/* Super block   block 1           Contains information about the layout of the file system */
-/* Entries tab   blocks 2 to n     Table of file and directory entries */
-/* Data blocks   blocks n to end   Data blocks referenced by file entries */
+/* Super block   byte 512          Contains information about the layout of the file system */
+/* Entries tab   blocks e to n     Table of file and directory entries */
+/* Blocks map    blocks n to m     Free blocks bitmap */
+/* Entries map   blocks m to k     Free entries bitmap */
+/* Data blocks   blocks k to end   Data blocks referenced by file entries */
+
+/* The super block is always the second sector of the disk. So it's block 1
+ * with 512 bytes blocks, and it's in block 0 with bigger blocks.
+ * The entries table starts at the next block, e = SFS_ENTRIESSTART(blocksize)
+ */
+#define SFS_ENTRIESSTART(blocksize) ((blocksize) > BLOCK_SIZE ? 1 : 2)
 
 /* Entries are referenced by their index on the entry table
  * Entry with index n is located at byte:
- *   2*BLOCK_SIZE + n*sizeof(sfs_entry_t)
+ *   e*blocksize + n*sizeof(sfs_entry_t)
+ *
+ * The blocks bitmap starts at the block after the entries table:
+ *   e + ceil((superblock.nentries*sizeof(sfs_entry_t)) / blocksize)
+ *
+ * Bit (n % 8) of byte (n / 8) of the blocks bitmap is set when block n is
+ * used. Blocks before data blocks are always set as used.
+ *
+ * The entries bitmap starts at block
+ *   superblock.bitmapstart + superblock.bitmapblocks
+ *
+ * Bit (n % 8) of byte (n / 8) of the entries bitmap is set when entry n
+ * is used.
+ *
+ * Entries from superblock.entryhwm (high-water mark) to the end of the
+ * table have never been used. They are free and their contents are not
+ * meaningful, so they are never read. This way formatting a disk does not
+ * need to clear the entries table, and searches for free entries stop at
+ * this mark. It's increased when an entry past it is used
  *
  * Data blocks start at block
- *   2 + ((superblock.nentries*sizeof(sfs_entry_t)) / BLOCK_SIZE)
+ *   superblock.entrymapstart + superblock.entrymapblocks
+ * which is also superblock.bootstart
  *
  * Data blocks are referenced by their absolute disk block index
  */
 
-/* SFS 1.0 ID used in superblock.type */
-#define SFS_TYPE_ID 0x05F50010
+/* SFS 1.7 ID used in superblock.type */
+#define SFS_TYPE_ID 0x05F50017
+
+/* Older revisions are supported only for reading:
+ * SFS 1.0 has no bitmaps, and data blocks start after the entries table
+ * SFS 1.1 has no entries bitmap
+ * SFS 1.2 has no extents
+ * SFS 1.3 has no inline files
+ * SFS 1.4 has no blocksize, blocks are always 512 bytes
+ * SFS 1.5 has no name hashes in directory references
+ * SFS 1.6 has no entries high-water mark, all entries are initialized */
+#define SFS_TYPE_ID_1_0 0x05F50010
+#define SFS_TYPE_ID_1_5 0x05F50015
 
 typedef struct {  /* On-disk superblock structure */
-  uint32_t  type;         /* Type of file system. Must be SFS_TYPE_ID */
-  uint32_t  size;         /* Total number of block in file system */
-  uint32_t  nentries;     /* Number of entries in entries table */
-  uint32_t  bootstart;    /* Block index of first boot program block */
+  uint32_t  type;           /* Type of file system. Must be SFS_TYPE_ID */
+  uint32_t  size;           /* Total number of block in file system */
+  uint32_t  nentries;       /* Number of entries in entries table */
+  uint32_t  bootstart;      /* Block index of first boot program block */
+  uint32_t  bitmapstart;    /* Block index of first blocks bitmap block */
+  uint32_t  bitmapblocks;   /* Number of blocks of the blocks bitmap */
+  uint32_t  entrymapstart;  /* Block index of first entries bitmap block */
+  uint32_t  entrymapblocks; /* Number of blocks of the entries bitmap */
+  uint32_t  blocksize;      /* Size of blocks in bytes */
+  uint32_t  entryhwm;       /* Entries high-water mark. See above */
 } sfs_superblock_t;
 
+#define SFS_BITMAPBITS(blocksize) ((blocksize)*8) /* Bits in a bitmap block */
+
 /* The boot program must be stored in contiguous data blocks */
 
 #define SFS_NAMESIZE    15  /* Max length of entry name + final 0 */
 #define SFS_ENTRYREFS  120  /* Number of references in a single entry */
+#define SFS_INLINESIZE (SFS_ENTRYREFS*4) /* Max size of inline files */
+#define SFS_REFENTRY(ref) ((uint)((ref) & 0xFFFFL)) /* Dir ref entry index */
+#define SFS_REFHASH(ref)  ((uint)((ref) >> 16))      /* Dir ref name hash */
 
 /* Entry flags */
 #define T_DIR  0x01  /* Type: Directory */
 #define T_FILE 0x02  /* Type: File */
+#define F_EXTENTS 0x04  /* File references are extents. See below */
+#define F_INLINE  0x08  /* File data is in the references. See below */
 
 #define F_USED (T_DIR | T_FILE) /* Not a flag! Used to find free entries */
 /* ( (entry flags & F_USED) == 0 ) means this is a free entry */
@@ -74,6 +131,14 @@ typedef struct {  /* On-disk superblock structure */
 /* References in file entries contain ordered data block indexes
  * References in directory entries contain subentries indexes
  *
+ * Directory index:
+ * The low 16 bits of a directory reference are the subentry index, and
+ * the high 16 bits are a hash of the subentry name, so a name is looked up
+ * comparing hashes, and only reading the subentries whose hash matches.
+ * The hash of a name is computed, modulo 65536, as:
+ *   hash = 0; for each name character c: hash = hash*31 + c
+ * So there can be at most 65536 entries
+ *
  * A reference with value 0 means unused reference
  * All used references must be always packed before unused references
  *
@@ -97,6 +162,21 @@ typedef struct {  /* On-disk superblock structure */
  * directory (a chained entry), contains a reference to the previous entry in
  * the chain.
  *
+ * Extents:
+ * File entries with the F_EXTENTS flag contain extents instead of single
+ * block references. Each extent is a pair of references: ref[2*i] is the
+ * first data block of extent i, and ref[2*i+1] its number of contiguous
+ * data blocks. An extent with length 0 means no more extents. So a chained
+ * entry is only needed when a file has more than SFS_ENTRYREFS/2 extents.
+ * All files are created with extents since SFS 1.3
+ *
+ * Inline files:
+ * File entries with the F_INLINE flag contain the file data itself in
+ * their references, instead of data blocks. Files up to SFS_INLINESIZE
+ * bytes are inline, and they use extents when they grow. Inline files
+ * have no data blocks and no chained entries. Bytes of the references
+ * after the file size are always 0. Files are created inline since SFS 1.4
+ *
  * The root dir of a disk is always entry index 0, with name "." and parent 0.
  * With the current implementation, the boot program must be entry index 1.
  */
@@ -153,6 +233,39 @@ void fs_init_info();
  */
 uint fs_get_info(uint disk_index, fs_info_t* info);
 
+/*
+ * Write all modified cached disk sectors to disk
+ * Call this before disks can be removed or system is shut down
+ * Returns 0 on success
+ */
+uint fs_cache_flush();
+
+/*
+ * Check if a disk has modified cached sectors
+ * Can be called from interrupt handlers
+ */
+uint fs_cache_dirty(uint disk);
+
+/*
+ * Write modified cached sectors of floppy disks which have not been
+ * accessed for FS_CACHE_IDLE_MS, so their motors can be turned off.
+ * Motors are turned off 3000ms after the last access, but only if
+ * there are no modified sectors, because they can't be written from
+ * the timer interrupt handler. So call this often, out of interrupt
+ * handlers. Modified sectors of a floppy disk are discarded once its
+ * motors are off, since the disk could have been replaced
+ */
+#define FS_CACHE_IDLE_MS 2000
+void fs_cache_idle();
+
+/* Disk cache statistics */
+extern ul_t fs_cache_hits;
+extern ul_t fs_cache_misses;
+
+/* Max number of sectors read in advance when files are read
+ * sequentially. 0 disables read-ahead */
+extern uint fs_readahead;
+
 /*
  * Get filesystem entry
  * Output: entry
@@ -169,9 +282,10 @@ uint fs_get_entry(sfs_entry_t* entry, uchar* path, uint parent, uint disk);
  * Read file
  * Output: buff
  * Reads count bytes of path file starting at byte offset inside this file.
+ * buff is a linear address, so data can be read directly in far memory
  * Returns number of readed bytes or ERROR_NOT_FOUND
  */
-uint fs_read_file(uchar* buff, uchar* path, uint offset, uint count);
+uint fs_read_file(lp_t buff, uchar* path, uint offset, uint count);
 /*
  * Write file flags
  */
@@ -182,9 +296,80 @@ uint fs_read_file(uchar* buff, uchar* path, uint offset, uint count);
  * Writes count bytes of path file starting at byte offset inside this file.
  * If target file is not big enough, its size is increased.
  * Depending on flags, path file can be created or truncated.
+ * buff is a linear address
  * Returns number of written bytes or ERROR_NOT_FOUND
  */
-uint fs_write_file(uchar* buff, uchar* path, uint offset, uint count, uint flags);
+uint fs_write_file(lp_t buff, uchar* path, uint offset, uint count, uint flags);
+
+/*
+ * Open files
+ * Open files are looked up only once, and keep their current position,
+ * so they can be read or written sequentially without walking the path
+ * and the chained entries again for each access
+ */
+#define FS_MAX_FILES 8 /* Max number of simultaneously open files */
+
+/*
+ * Open file
+ * flags are the same than in fs_write_file
+ * If WF_TRUNCATE is set, file size becomes 0
+ * Position is set to 0
+ * Returns a file handle or an error code:
+ * - ERROR_NOT_FOUND if path does not exist or it's a directory
+ * - ERROR_NO_SPACE if too many files are open
+ */
+uint fs_open(uchar* path, uint flags);
+
+/*
+ * Read open file
+ * Output: buff
+ * Reads count bytes of file handle starting at its position in buff
+ * (linear address), and advances position
+ * Returns number of readed bytes or an error code
+ */
+uint fs_read(uint handle, lp_t buff, uint count);
+
+/*
+ * Read open file asynchronously
+ * Starts reading up to count bytes of file handle at its position in
+ * buff (linear address), and advances position. If done is provided,
+ * it's the linear address of a uint which becomes 0 and then, once data
+ * is available in buff, 1, or an error code if it fails.
+ * Whole sectors of contiguous blocks are read in background with DMA if
+ * the disk supports it. Otherwise, data is read before returning.
+ * Only one asynchronous read per file can be in progress: another
+ * read of the same file, or closing it, waits for the previous one
+ * Returns number of bytes being read, which can be less than count
+ * before the end of file, or an error code
+ */
+uint fs_read_async(uint handle, lp_t buff, uint count, lp_t done);
+
+/*
+ * Write open file
+ * Writes count bytes of buff (linear address) to file handle starting at
+ * its position, and advances position. If file is not big enough, its
+ * size is increased
+ * Returns number of written bytes or an error code
+ */
+uint fs_write(uint handle, lp_t buff, uint count);
+
+/*
+ * Set open file position
+ * Returns new position or ERROR_NOT_FOUND
+ */
+uint fs_seek(uint handle, uint offset);
+
+/*
+ * Close open file
+ * Returns 0 on success
+ */
+uint fs_close(uint handle);
+
+/*
+ * Close all open files
+ * Call this when a user program finishes
+ */
+void fs_close_all();
 
 /*
  * Move entry
@@ -234,6 +419,19 @@ uint fs_create_directory(uchar* path);
  */
 uint fs_list(sfs_entry_t* entry, uchar* path, uint n);
 
+/*
+ * Read directory entries
+ * Output: entries (linear address of an array of n fs_entry_t)
+ * Reads up to n items of path directory, starting at item *cookie,
+ * and advances *cookie past them. Set *cookie to 0 to start.
+ * The directory is looked up once per call. If it is modified
+ * between calls, items may be skipped or repeated
+ * Returns:
+ * - ERROR_NOT_FOUND if path does not exist or is not a directory
+ * - number of entries read otherwise, 0 after the last one
+ */
+uint fs_readdir(lp_t entries, uint n, uchar* path, uint* cookie);
+
 /*
  * Create filesystem in disk
  * Deletes all files, creates NSFS filesystem
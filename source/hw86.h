@@ -79,13 +79,19 @@ extern uchar io_in_char_serial();
  */
 extern uint get_disk_info(uint disk, uint* st, uint* hd, uint* cl);
 /*
- * Read disk sector
+ * Check if disk supports int 0x13 extensions (LBA)
  */
-extern uint read_disk_sector(uint disk, uint sector, uint n, uchar* buff);
+extern uint get_disk_lba(uint disk);
 /*
- * Write disk sector
+ * Read n disk sectors to buff (linear address)
+ * LBA is used if the disk supports it, CHS otherwise
  */
-extern uint write_disk_sector(uint disk, uint sector, uint n, uchar* buff);
+extern uint read_disk_sector(uint disk, ul_t sector, uint n, lp_t buff);
+/*
+ * Write n disk sectors from buff (linear address)
+ * LBA is used if the disk supports it, CHS otherwise
+ */
+extern uint write_disk_sector(uint disk, ul_t sector, uint n, lp_t buff);
 /*
  * Turn off floppy disk motors
  */
@@ -102,6 +108,15 @@ extern void lmem_setbyte(lp_t addr, uchar b);
  * Get far memory byte
  */
 extern uchar lmem_getbyte(lp_t addr);
+/*
+ * Copy n bytes of far memory
+ * Ranges can overlap
+ */
+extern void lmem_copy(lp_t dst, lp_t src, uint n);
+/*
+ * Set n bytes of far memory to value
+ */
+extern void lmem_fill(lp_t dst, uchar value, uint n);
 /*
  * User program far call
  */
@@ -130,6 +145,14 @@ extern void outl(ul_t value, uint port);
  * Read long from port
  */
 extern ul_t inl(uint port);
+/*
+ * Read n words from port to dst (linear address)
+ */
+extern void insw_lmem(uint port, lp_t dst, uint n);
+/*
+ * Write n words from src (linear address) to port
+ */
+extern void outsw_lmem(uint port, lp_t src, uint n);
 /*
  * Power off system using APM
  */
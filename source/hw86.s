@@ -515,70 +515,20 @@ _get_time:
 
 
 ;
-; uint read_disk_sector(uint disk, uint sector, uint n, uchar* buff)
-; Read a disk sector
+; uint read_disk_sector(uint disk, ul_t sector, uint n, lp_t buff)
+; Read n disk sectors to buff (linear address)
 ;
 global _read_disk_sector
 _read_disk_sector:
   pusha
 
   mov  bx, sp           ; Save the stack pointer
-  mov  al, [bx+18]
-  mov  [tdev], al
-  call set_disk_params
-  mov  ax, [bx+20]      ; Ax = start logical sector
-
-  cmp  byte [dsects], 0
-  je   .param_failure
-  cmp  byte [dsides], 0
-  je   .param_failure
-
-  call disk_lba_to_hts
-
   mov  ah, 2            ; Params for int 0x13: read disk sectors
-  mov  al, [bx+22]      ; Number of sectors to read
-  mov  si, [bx+24]      ; Set ES:BX to point the buffer
-  mov  bx, ds
-  mov  es, bx
-  mov  bx, si
-
-  mov  word [.n], 0
-
-  pusha                 ; Prepare to enter loop
-
-.read_loop:
-  popa
-  pusha
-
-  stc                   ; A few BIOSes do not set properly on error
-  int  0x13             ; Read sectors
-
-  jnc  .read_finished
-
-  inc  word [.n]
-  cmp  word [.n], 2
-  jg   .read_failure
-
-  call disk_reset       ; Reset controller and try again
-  jnc  .read_loop       ; Disk reset OK?
-  jmp  .read_failure    ; Fatal double error
-
-.read_finished:
-  popa                  ; Restore registers from main loop
-  popa                  ; And restore from start of this system call
-  mov  ax, 0            ; Return 0 (for success)
-  ret
-
-.read_failure:
+  call disk_transfer
   mov  [.n], ax
-  popa
-  popa
-  mov  ax, [.n]         ; Return 1 (for failure)
-  ret
 
-.param_failure:
   popa
-  mov  ax, 1
+  mov  ax, [.n]         ; Return 0 (for success) or error code
   ret
 
 .n dw 0
@@ -603,54 +553,124 @@ _turn_off_fd_motors:
 
 
 ;
-; uint write_disk_sector(uint disk, uint sector, uint n, uchar* buff)
-; Write disk sector
+; uint write_disk_sector(uint disk, ul_t sector, uint n, lp_t buff)
+; Write n disk sectors from buff (linear address)
 ;
 global _write_disk_sector
 _write_disk_sector:
   pusha
 
   mov  bx, sp           ; Save the stack pointer
+  mov  ah, 3            ; Params for int 0x13: write disk sectors
+  call disk_transfer
+  mov  [.n], ax
+
+  popa
+  mov  ax, [.n]         ; Return 0 (for success) or error code
+  ret
+
+.n dw 0
+
+
+;
+; disk_transfer -- Read or write disk sectors
+; IN: AH = 2 to read or 3 to write, BX = stack pointer after pusha
+; in read_disk_sector or write_disk_sector, to access their params
+; OUT: AX = 0 on success, error code otherwise
+;
+; If the disk supports int 0x13 extensions, sectors are addressed with
+; LBA through the disk address packet. Otherwise, or if the extended
+; call fails, they are addressed with CHS
+;
+disk_transfer:
+  mov  [.op], ah
   mov  al, [bx+18]
   mov  [tdev], al
   call set_disk_params
-  mov  ax, [bx+20]      ; Ax = start logical sector
 
+  mov  ax, [bx+24]      ; Number of sectors
+  mov  [dap.count], ax
+  mov  eax, [bx+26]     ; Buffer linear address to segment:offset
+  mov  dx, ax
+  and  dx, 0x000F
+  mov  [dap.offset], dx
+  shr  eax, 4
+  mov  [dap.segment], ax
+  mov  eax, [bx+20]     ; Start logical sector
+  mov  [dap.lba], eax
+
+  mov  word [.n], 0
+
+  cmp  byte [dlba], 0   ; Extensions supported?
+  je   .chs
+
+.lba_loop:
+  mov  ah, [.op]
+  add  ah, 0x40         ; Extended read (0x42) or write (0x43)
+  mov  al, 0            ; No write verify
+  mov  dl, [tdev]
+  mov  si, dap          ; DS:SI points to the disk address packet
+  stc                   ; A few BIOSes do not set properly on error
+  int  0x13
+  jnc  .done
+
+  inc  word [.n]
+  cmp  word [.n], 2
+  jg   .chs_fallback
+  call disk_reset       ; Reset controller and try again
+  jnc  .lba_loop
+
+.chs_fallback:
+  mov  word [.n], 0
+
+.chs:
   cmp  byte [dsects], 0
   je   .param_failure
   cmp  byte [dsides], 0
   je   .param_failure
+  mov  ax, [bx+22]      ; Sector must be addressable with CHS
+  cmp  ax, [dsects]
+  jae  .param_failure
 
+.chs_loop:
+  mov  ax, [bx+20]      ; DX:AX = start logical sector
+  mov  dx, [bx+22]
   call disk_lba_to_hts
 
-  mov  ah, 3            ; Params for int 0x13: write disk sectors
-  mov  al, [bx+22]      ; Number of sectors to read
-  mov  si, [bx+24]      ; Set ES:BX to point the buffer
-  mov  bx, ds
+  push bx
+  push es
+  mov  ah, [.op]        ; Params for int 0x13: read or write disk sectors
+  mov  al, [dap.count]  ; Number of sectors
+  mov  bx, [dap.segment] ; Set ES:BX to point the buffer
   mov  es, bx
-  mov  bx, si
-
+  mov  bx, [dap.offset]
   stc                   ; A few BIOSes do not set properly on error
-  int  0x13             ; Read sectors
+  int  0x13
+  pop  es
+  pop  bx
+  jnc  .done
 
-  jc   .write_failure
+  inc  word [.n]
+  cmp  word [.n], 2
+  jg   .failure
+  push ax
+  call disk_reset       ; Reset controller and try again
+  pop  ax
+  jnc  .chs_loop        ; Disk reset OK?
 
-  popa                  ; And restore from start of this system call
-  mov  ax, 0            ; Return 0 (for success)
-  ret
+.failure:
+  ret                   ; Return int 0x13 error code
 
-.write_failure:
-  mov  [.n], ax
-  popa
-  mov  ax, [.n]         ; Return error code
+.done:
+  mov  ax, 0
   ret
 
 .param_failure:
-  popa
   mov  ax, 1
   ret
 
-.n dw 0
+.op db 0
+.n  dw 0
 
 tdev db 0
 
@@ -675,26 +695,22 @@ disk_reset:
 
 ;
 ; disk_lba_to_hts -- Calculate head, track and sector for int 0x13
-; IN: logical sector in AX; OUT: correct registers for int 0x13
+; IN: logical sector in DX:AX; OUT: correct registers for int 0x13
 ;
 disk_lba_to_hts:
   push bx
   push ax
 
-  mov  bx, ax           ; Save logical sector
-
-  mov  dx, 0            ; First the sector
   div  word [dsects]    ; Sectors per track
   add  dl, 01           ; Physical sectors start at 1
   mov  cl, dl           ; Sectors belong in CL for int 0x13
-  mov  ax, bx
 
-  mov  dx, 0            ; Now calculate the head
-  div  word [dsects]    ; Sectors per track
-  mov  dx, 0
+  mov  dx, 0            ; Now calculate the head from logical track in AX
   div  word [dsides]    ; Disk sides
   mov  dh, dl           ; Head/side
   mov  ch, al           ; Track
+  shl  ah, 6            ; Track bits 8-9 belong in CL bits 6-7
+  or   cl, ah
 
   pop  ax
   pop  bx
@@ -714,6 +730,10 @@ struc DISKINFO
   .cylinders  resw 1
   .disk_size  resd 1
   .last_accss resd 1
+  .lba        resw 1
+  .ata        resw 1
+  .fdc        resw 1
+  .cached     resw 1
   .size:
 endstruc
 
@@ -735,6 +755,8 @@ set_disk_params:
   mov  [dsects], bx
   mov  bx, [_disk_info + eax + DISKINFO.sides]
   mov  [dsides], bx
+  mov  bx, [_disk_info + eax + DISKINFO.lba]
+  mov  [dlba], bl
   mov  ebx, [_system_timer_ms]
   mov  [_disk_info + eax + DISKINFO.last_accss], ebx
 
@@ -805,8 +827,48 @@ _get_disk_info:
   ret
 
 
+;
+; uint get_disk_lba(uint disk)
+; Returns 1 if disk supports int 0x13 extensions, 0 otherwise
+;
+global _get_disk_lba
+_get_disk_lba:
+  pusha
+
+  mov  bx, sp           ; Save the stack pointer
+  mov  dl, [bx+18]
+  mov  ah, 0x41         ; Check extensions present
+  mov  bx, 0x55AA
+  stc
+  int  0x13
+  jc   .no_lba
+  cmp  bx, 0xAA55
+  jne  .no_lba
+  test cx, 1            ; Disk address packet functions supported?
+  jz   .no_lba
+
+  popa
+  mov  ax, 1
+  ret
+
+.no_lba:
+  popa
+  mov  ax, 0
+  ret
+
+
 dsects dw 0             ; Current disk sectors per track
 dsides dw 0             ; Current disk sides
+dlba   db 0             ; Current disk supports int 0x13 extensions
+
+dap:                    ; Disk address packet for int 0x13 extensions
+.size     db 0x10
+.reserved db 0
+.count    dw 0          ; Number of sectors
+.offset   dw 0          ; Buffer offset
+.segment  dw 0          ; Buffer segment
+.lba      dd 0          ; Start logical sector
+.lba_high dd 0
 
 
 ;
@@ -929,6 +991,62 @@ _inl:
   ret
 
 
+;
+; void insw_lmem(uint port, lp_t dst, uint n)
+; Read n words from port to dst (linear address)
+;
+global _insw_lmem
+_insw_lmem:
+  push bp
+  mov  bp, sp
+  pushad
+  push es
+
+  mov  dx, [bp+4]
+  mov  eax, [bp+6]      ; es:di = dst
+  mov  di, ax
+  and  di, 0x000F
+  shr  eax, 4
+  mov  es, ax
+  mov  cx, [bp+10]
+
+  cld
+  rep  insw
+
+  pop  es
+  popad
+  pop  bp
+  ret
+
+
+;
+; void outsw_lmem(uint port, lp_t src, uint n)
+; Write n words from src (linear address) to port
+;
+global _outsw_lmem
+_outsw_lmem:
+  push bp
+  mov  bp, sp
+  pushad
+  push ds
+
+  mov  dx, [bp+4]
+  mov  cx, [bp+10]
+  mov  eax, [bp+6]      ; ds:si = src
+  mov  si, ax
+  and  si, 0x000F
+  shr  eax, 4
+  mov  ds, ax
+
+  cld
+  rep  outsw
+
+  pop  ds
+  popad
+  pop  bp
+  ret
+
+
 ;
 ; void apm_shutdown()
 ; Power off system using APM
@@ -1053,6 +1171,106 @@ _lmem_getbyte:
   ret
 
 
+;
+; void lmem_copy(lp_t dst, lp_t src, uint n)
+; Copy n bytes of far memory
+; Ranges can overlap
+;
+global _lmem_copy
+_lmem_copy:
+  push bp
+  mov  bp, sp
+  pushad
+  push ds
+  push es
+
+  mov  eax, [bp+4]      ; es:di = dst
+  mov  di, ax
+  and  di, 0x000F
+  shr  eax, 4
+  mov  es, ax
+  mov  eax, [bp+8]      ; ds:si = src
+  mov  si, ax
+  and  si, 0x000F
+  shr  eax, 4
+  mov  cx, [bp+12]
+  mov  ds, ax
+
+  mov  eax, [bp+4]      ; Copy backwards if dst
+  cmp  eax, [bp+8]      ; is after src
+  ja   .backwards
+
+  cld
+  mov  dx, cx           ; Copy dwords, then remaining bytes
+  shr  cx, 2
+  rep  movsd
+  mov  cx, dx
+  and  cx, 3
+  rep  movsb
+  jmp  .done
+
+.backwards:
+  jcxz .done
+  std
+  add  si, cx           ; Start at last bytes
+  dec  si
+  add  di, cx
+  dec  di
+  mov  dx, cx           ; Copy remaining bytes, then dwords
+  and  cx, 3
+  rep  movsb
+  sub  si, 3
+  sub  di, 3
+  mov  cx, dx
+  shr  cx, 2
+  rep  movsd
+  cld
+
+.done:
+  pop  es
+  pop  ds
+  popad
+  pop  bp
+  ret
+
+
+;
+; void lmem_fill(lp_t dst, uchar value, uint n)
+; Set n bytes of far memory to value
+;
+global _lmem_fill
+_lmem_fill:
+  push bp
+  mov  bp, sp
+  pushad
+  push es
+
+  mov  eax, [bp+4]      ; es:di = dst
+  mov  di, ax
+  and  di, 0x000F
+  shr  eax, 4
+  mov  es, ax
+  mov  al, [bp+8]       ; Value in each byte of eax
+  mov  ah, al
+  mov  dx, ax
+  shl  eax, 16
+  mov  ax, dx
+  mov  cx, [bp+10]
+
+  cld
+  mov  dx, cx           ; Set dwords, then remaining bytes
+  shr  cx, 2
+  rep  stosd
+  mov  cx, dx
+  and  cx, 3
+  rep  stosb
+
+  pop  es
+  popad
+  pop  bp
+  ret
+
+
 ;
 ; Enter kernel mode
 ; Replace stack and data segments
@@ -1374,6 +1592,65 @@ IRQNET_handler:
 extern _net_handler
 
 
+;
+; Handlers for the IRQ14 and IRQ15
+; Used by ATA primary and secondary channels
+;
+IRQ14_handler:
+  pushad
+  call _enter_kernel
+
+  push word 0
+  call _ata_handler
+  pop  ax
+
+  mov  al, PIC_EOI
+  out  PORT_SPIC_COMMAND, al         ; Send the EOI to the PIC
+  out  PORT_MPIC_COMMAND, al         ; Send the EOI to the PIC
+
+  call _leave_kernel
+  popad
+  iret
+
+IRQ15_handler:
+  pushad
+  call _enter_kernel
+
+  push word 1
+  call _ata_handler
+  pop  ax
+
+  mov  al, PIC_EOI
+  out  PORT_SPIC_COMMAND, al         ; Send the EOI to the PIC
+  out  PORT_MPIC_COMMAND, al         ; Send the EOI to the PIC
+
+  call _leave_kernel
+  popad
+  iret
+
+extern _ata_handler
+
+
+;
+; Handler for the IRQ6
+; Used by floppy disk controller
+;
+IRQ6_handler:
+  pushad
+  call _enter_kernel
+
+  call _fdc_handler
+
+  mov  al, PIC_EOI
+  out  PORT_MPIC_COMMAND, al         ; Send the EOI to the PIC
+
+  call _leave_kernel
+  popad
+  iret
+
+extern _fdc_handler
+
+
 ;
 ; void PIC_init()
 ; Initialize PIC
@@ -1521,6 +1798,74 @@ _install_net_IRQ_handler:
 
 extern _net_irq ; netword IRQ number, assumed > 8
 
+
+;
+; void install_ata_IRQ_handlers()
+; Add ATA routines to interrupt vector table (IRQ14 and IRQ15)
+;
+global _install_ata_IRQ_handlers
+_install_ata_IRQ_handlers:
+  pusha
+  push es
+  cli
+
+  ; Install handlers
+  mov  ax, 0
+  mov  es, ax
+  mov  dx, IRQ14_handler
+  mov  [es:(INT_CODE_SPIC_BASE+6)*4], dx
+  mov  dx, IRQ15_handler
+  mov  [es:(INT_CODE_SPIC_BASE+7)*4], dx
+  mov  ax, cs
+  mov  [es:(INT_CODE_SPIC_BASE+6)*4+2], ax
+  mov  [es:(INT_CODE_SPIC_BASE+7)*4+2], ax
+
+  ; Set IRQ14 and IRQ15 unmasked
+  in   al, PORT_SPIC_DATA
+  and  al, 00111111b
+  out  PORT_SPIC_DATA, al
+
+  ; Set IRQ2 (Slave PIC) unmasked
+  in   al, PORT_MPIC_DATA
+  and  al, 11111101b
+  out  PORT_MPIC_DATA, al
+
+  sti
+  pop  es
+  popa
+
+  ret
+
+
+;
+; void install_fdc_IRQ_handler()
+; Add floppy disk controller routine to interrupt vector table (IRQ6)
+;
+global _install_fdc_IRQ_handler
+_install_fdc_IRQ_handler:
+  pusha
+  push es
+  cli
+
+  ; Install handler
+  mov  ax, 0
+  mov  es, ax
+  mov  dx, IRQ6_handler
+  mov  [es:(INT_CODE_MPIC_BASE+6)*4], dx
+  mov  ax, cs
+  mov  [es:(INT_CODE_MPIC_BASE+6)*4+2], ax
+
+  ; Set IRQ6 unmasked
+  in   al, PORT_MPIC_DATA
+  and  al, 10111111b
+  out  PORT_MPIC_DATA, al
+
+  sti
+  pop  es
+  popa
+
+  ret
+
 ;
 ; Install IRS
 ;
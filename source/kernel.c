@@ -10,6 +10,8 @@
 #include "fs.h"
 #include "video.h"
 #include "net.h"
+#include "ata.h"
+#include "fdc.h"
 #include "cli.h"
 
 uchar a20_enabled = 0; /* A20 line enabled */
@@ -130,10 +132,11 @@ static heap_free(void* ptr)
  * Far memory handling
  * Public memory
  */
-#define LMEM_START 0x00028000L
+#define LMEM_START 0x0003C800L /* After disk buffers */
 #define LMEM_LIMIT 0x0009FC00L
 #define LMEM_BLOCK_SIZE 0x10L
 #define LMEM_MAX_BLOCK 64
+#define LMEM_CHUNK 0x8000L /* Max bytes copied or set at once */
 struct lmemblock_info {
   lp_t start;
   ul_t size;
@@ -260,6 +263,9 @@ static uint BCD_to_int(uchar BCD)
  */
 uint kernel_service(uint cs, uint service, lp_t lparam)
 {
+  /* Write cached changes of idle floppy disks */
+  fs_cache_idle();
+
   switch(service) {
 
     case SYSCALL_IO_GET_VIDEO_MODE:
@@ -267,7 +273,7 @@ uint kernel_service(uint cs, uint service, lp_t lparam)
 
     case SYSCALL_IO_SET_VIDEO_MODE: {
       uint mode = 0;
-      lmemcpy(lp(&mode), lparam, lsizeof(mode));
+      lmem_copy(lp(&mode), lparam, sizeof(mode));
       if(mode==VM_TEXT && graphics_mode==0) {
         io_set_text_mode();
       } else if(mode==VM_GRAPHICS && graphics_mode==1) {
@@ -278,13 +284,13 @@ uint kernel_service(uint cs, uint service, lp_t lparam)
 
     case SYSCALL_IO_GET_SCREEN_SIZE: {
       syscall_position_t ps;
-      lmemcpy(lp(&ps), lparam, lsizeof(ps));
+      lmem_copy(lp(&ps), lparam, sizeof(ps));
       if(ps.x == SSM_CHARS) {
-        lmemcpy(ps.px, lp(&screen_width_c), lsizeof(screen_width_c));
-        lmemcpy(ps.py, lp(&screen_height_c), lsizeof(screen_height_c));
+        lmem_copy(ps.px, lp(&screen_width_c), sizeof(screen_width_c));
+        lmem_copy(ps.py, lp(&screen_height_c), sizeof(screen_height_c));
       } else {
-        lmemcpy(ps.px, lp(&screen_width_px), lsizeof(screen_width_px));
-        lmemcpy(ps.py, lp(&screen_height_px), lsizeof(screen_height_px));
+        lmem_copy(ps.px, lp(&screen_width_px), sizeof(screen_width_px));
+        lmem_copy(ps.py, lp(&screen_height_px), sizeof(screen_height_px));
       }
       return 0;
     }
@@ -295,14 +301,14 @@ uint kernel_service(uint cs, uint service, lp_t lparam)
 
     case SYSCALL_IO_SET_PIXEL: {
       syscall_posattr_t ca;
-      lmemcpy(lp(&ca), lparam, lsizeof(ca));
+      lmem_copy(lp(&ca), lparam, sizeof(ca));
       video_set_pixel(ca.x, ca.y, ca.c);
       return 0;
     }
 
     case SYSCALL_IO_DRAW_CHAR: {
       syscall_posattr_t ca;
-      lmemcpy(lp(&ca), lparam, lsizeof(ca));
+      lmem_copy(lp(&ca), lparam, sizeof(ca));
       draw_char(ca.x, ca.y, ca.c, ca.attr, NO_BACKGROUND);
       return 0;
     }
@@ -313,30 +319,30 @@ uint kernel_service(uint cs, uint service, lp_t lparam)
 
     case SYSCALL_IO_OUT_CHAR_ATTR: {
       syscall_posattr_t ca;
-      lmemcpy(lp(&ca), lparam, lsizeof(ca));
+      lmem_copy(lp(&ca), lparam, sizeof(ca));
       io_out_char_attr(ca.x, ca.y, ca.c, ca.attr);
       return 0;
     }
 
     case SYSCALL_IO_SET_CURSOR_POS: {
       syscall_position_t ps;
-      lmemcpy(lp(&ps), lparam, lsizeof(ps));
+      lmem_copy(lp(&ps), lparam, sizeof(ps));
       io_set_cursor_pos(ps.x, ps.y);
       return 0;
     }
 
     case SYSCALL_IO_GET_CURSOR_POS: {
       syscall_position_t ps;
-      lmemcpy(lp(&ps), lparam, lsizeof(ps));
+      lmem_copy(lp(&ps), lparam, sizeof(ps));
       io_get_cursor_pos(&ps.x, &ps.y);
-      lmemcpy(ps.px, lp(&ps.x), lsizeof(ps.x));
-      lmemcpy(ps.py, lp(&ps.y), lsizeof(ps.y));
+      lmem_copy(ps.px, lp(&ps.x), sizeof(ps.x));
+      lmem_copy(ps.py, lp(&ps.y), sizeof(ps.y));
       return 0;
     }
 
     case SYSCALL_IO_SET_SHOW_CURSOR: {
       uint mode=0;
-      lmemcpy(lp(&mode), lparam, lsizeof(mode));
+      lmem_copy(lp(&mode), lparam, sizeof(mode));
       if(mode == HIDE_CURSOR) {
         io_hide_cursor();
       } else {
@@ -347,9 +353,10 @@ uint kernel_service(uint cs, uint service, lp_t lparam)
 
     case SYSCALL_IO_IN_KEY: {
       uint mode=0, k=0;
-      lmemcpy(lp(&mode), lparam, lsizeof(mode));
+      lmem_copy(lp(&mode), lparam, sizeof(mode));
       do {
         k = io_in_key();
+        fs_cache_idle();
       } while((k==0 && mode==KM_WAIT_KEY) ||
         (k!=0 && mode==KM_CLEAR_BUFFER));
 
@@ -389,7 +396,7 @@ uint kernel_service(uint cs, uint service, lp_t lparam)
 
     case SYSCALL_IO_GET_MOUSE_STATE: {
       syscall_posattr_t pa;
-      lmemcpy(lp(&pa), lparam, lsizeof(pa));
+      lmem_copy(lp(&pa), lparam, sizeof(pa));
       pa.x = mouse_x;
       pa.y = mouse_y;
       pa.c = (mouse_b & 0x3);
@@ -397,7 +404,7 @@ uint kernel_service(uint cs, uint service, lp_t lparam)
         pa.x /= (screen_width_px/screen_width_c);
         pa.y /= (screen_height_px/screen_height_c);
       }
-      lmemcpy(lparam, lp(&pa), lsizeof(pa));
+      lmem_copy(lparam, lp(&pa), sizeof(pa));
       return 0;
     }
 
@@ -421,7 +428,7 @@ uint kernel_service(uint cs, uint service, lp_t lparam)
       if(cs != KERN_MEMSEG) {
         return 0;
       }
-      lmemcpy(lp(&size), lparam, lsizeof(size));
+      lmem_copy(lp(&size), lparam, sizeof(size));
       return heap_alloc(size);
     }
 
@@ -431,42 +438,72 @@ uint kernel_service(uint cs, uint service, lp_t lparam)
 
     case SYSCALL_LMEM_ALLOCATE: {
       syscall_lmem_t lm;
-      lmemcpy(lp(&lm), lparam, lsizeof(lm));
+      lmem_copy(lp(&lm), lparam, sizeof(lm));
       lm.dst = lmem_alloc(lm.n);
-      lmemcpy(lparam, lp(&lm), lsizeof(lm));
+      lmem_copy(lparam, lp(&lm), sizeof(lm));
       return 0;
     }
     case SYSCALL_LMEM_FREE: {
       syscall_lmem_t lm;
-      lmemcpy(lp(&lm), lparam, lsizeof(lm));
+      lmem_copy(lp(&lm), lparam, sizeof(lm));
       lmem_free(lm.dst);
       return 0;
     }
     case SYSCALL_LMEM_GET: {
       syscall_lmem_t lm;
-      uint i = 0;
-      for(i=0; i<lsizeof(lm); i++) {
-        ((uint8_t*)(&lm))[i] = lmem_getbyte(lparam+i);
-      }
+      lmem_copy(lp(&lm), lparam, sizeof(lm));
       return lmem_getbyte(lm.dst);
     }
     case SYSCALL_LMEM_SET: {
       syscall_lmem_t lm;
-      uint i = 0;
-      for(i=0; i<lsizeof(lm); i++) {
-        ((uint8_t*)(&lm))[i] = lmem_getbyte(lparam+i);
-      }
+      lmem_copy(lp(&lm), lparam, sizeof(lm));
       lmem_setbyte(lm.dst, (uint8_t)lm.n);
       return 0;
     }
+    case SYSCALL_LMEM_COPY: {
+      syscall_lmemop_t lm;
+      uint c = 0;
+      lmem_copy(lp(&lm), lparam, sizeof(lm));
+
+      /* Copy in chunks. If dst overlaps the end
+       * of src, start with the last one */
+      if(lm.dst > lm.src && lm.dst < lm.src + lm.n) {
+        while(lm.n > 0) {
+          c = (uint)min(lm.n, LMEM_CHUNK);
+          lm.n -= c;
+          lmem_copy(lm.dst + lm.n, lm.src + lm.n, c);
+        }
+      } else {
+        while(lm.n > 0) {
+          c = (uint)min(lm.n, LMEM_CHUNK);
+          lmem_copy(lm.dst, lm.src, c);
+          lm.dst += c;
+          lm.src += c;
+          lm.n -= c;
+        }
+      }
+      return 0;
+    }
+    case SYSCALL_LMEM_FILL: {
+      syscall_lmemop_t lm;
+      uint c = 0;
+      lmem_copy(lp(&lm), lparam, sizeof(lm));
+      while(lm.n > 0) {
+        c = (uint)min(lm.n, LMEM_CHUNK);
+        lmem_fill(lm.dst, (uchar)lm.value, c);
+        lm.dst += c;
+        lm.n -= c;
+      }
+      return 0;
+    }
 
     case SYSCALL_FS_GET_INFO: {
       syscall_fsinfo_t fi;
       fs_info_t info;
       uint result = 0;
-      lmemcpy(lp(&fi), lparam, lsizeof(fi));
+      lmem_copy(lp(&fi), lparam, sizeof(fi));
       result = fs_get_info(fi.disk_index, &info);
-      lmemcpy(fi.info, lp(&info), lsizeof(info));
+      lmem_copy(fi.info, lp(&info), sizeof(info));
       return result;
     }
 
@@ -476,68 +513,40 @@ uint kernel_service(uint cs, uint service, lp_t lparam)
       fs_entry_t o_entry;
       uchar path[MAX_PATH];
       uint result = 0;
-      lmemcpy(lp(&fi), lparam, lsizeof(fi));
-      lmemcpy(lp(path), fi.path, lsizeof(path));
+      lmem_copy(lp(&fi), lparam, sizeof(fi));
+      lmem_copy(lp(path), fi.path, sizeof(path));
       result = fs_get_entry(&entry, path, fi.parent, fi.disk);
       strcpy_s(o_entry.name, entry.name, sizeof(o_entry.name));
       o_entry.flags = entry.flags;
       o_entry.size = entry.size;
-      lmemcpy(fi.entry, lp(&o_entry), lsizeof(o_entry));
+      o_entry.time = entry.time;
+      lmem_copy(fi.entry, lp(&o_entry), sizeof(o_entry));
       return result;
     }
 
     case SYSCALL_FS_READ_FILE: {
       syscall_fsrwfile_t fi;
       uchar path[MAX_PATH];
-      uint offset = 0;
-      lmemcpy(lp(&fi), lparam, lsizeof(fi));
-      lmemcpy(lp(path), fi.path, lsizeof(path));
-      while(offset < fi.count) {
-        uchar tbuff[BLOCK_SIZE];
-        uint count = min(sizeof(tbuff), fi.count-offset);
-        uint read = fs_read_file(tbuff, path, fi.offset+offset, count);
-        if(read >= ERROR_ANY) {
-          offset = read;
-          break;
-        }
-        if(read == 0) {
-          break;
-        }
-        lmemcpy(fi.buff+(lp_t)offset, lp(tbuff), (ul_t)read);
-        offset += read;
-      }
-      return offset;
+      lmem_copy(lp(&fi), lparam, sizeof(fi));
+      lmem_copy(lp(path), fi.path, sizeof(path));
+      return fs_read_file(fi.buff, path, fi.offset, fi.count);
     }
 
     case SYSCALL_FS_WRITE_FILE: {
       syscall_fsrwfile_t fi;
       uchar path[MAX_PATH];
-      uint offset = 0;
-      lmemcpy(lp(&fi), lparam, lsizeof(fi));
-      lmemcpy(lp(path), fi.path, lsizeof(path));
-      while(offset < fi.count) {
-        uchar tbuff[BLOCK_SIZE];
-        uint write = 0;
-        uint count = min(sizeof(tbuff), fi.count-offset);
-        lmemcpy(lp(tbuff), fi.buff+(lp_t)offset, (ul_t)count);
-
-        write = fs_write_file(tbuff, path, fi.offset+offset, count, fi.flags);
-        if(write >= ERROR_ANY) {
-          offset = write;
-          break;
-        }
-        offset += write;
-      }
-      return offset;
+      lmem_copy(lp(&fi), lparam, sizeof(fi));
+      lmem_copy(lp(path), fi.path, sizeof(path));
+      return fs_write_file(fi.buff, path, fi.offset, fi.count, fi.flags);
     }
 
     case SYSCALL_FS_MOVE: {
       syscall_fssrcdst_t fi;
       uchar src[MAX_PATH];
       uchar dst[MAX_PATH];
-      lmemcpy(lp(&fi), lparam, lsizeof(fi));
-      lmemcpy(lp(src), fi.src, lsizeof(src));
-      lmemcpy(lp(dst), fi.dst, lsizeof(dst));
+      lmem_copy(lp(&fi), lparam, sizeof(fi));
+      lmem_copy(lp(src), fi.src, sizeof(src));
+      lmem_copy(lp(dst), fi.dst, sizeof(dst));
       return fs_move(src, dst);
     }
 
@@ -545,21 +554,21 @@ uint kernel_service(uint cs, uint service, lp_t lparam)
       syscall_fssrcdst_t fi;
       uchar src[MAX_PATH];
       uchar dst[MAX_PATH];
-      lmemcpy(lp(&fi), lparam, lsizeof(fi));
-      lmemcpy(lp(src), fi.src, lsizeof(src));
-      lmemcpy(lp(dst), fi.dst, lsizeof(dst));
+      lmem_copy(lp(&fi), lparam, sizeof(fi));
+      lmem_copy(lp(src), fi.src, sizeof(src));
+      lmem_copy(lp(dst), fi.dst, sizeof(dst));
       return fs_copy(src, dst);
     }
 
     case SYSCALL_FS_DELETE: {
       uchar path[MAX_PATH];
-      lmemcpy(lp(path), lparam, lsizeof(path));
+      lmem_copy(lp(path), lparam, sizeof(path));
       return fs_delete(path);
     }
 
     case SYSCALL_FS_CREATE_DIRECTORY: {
       uchar path[MAX_PATH];
-      lmemcpy(lp(path), lparam, lsizeof(path));
+      lmem_copy(lp(path), lparam, sizeof(path));
       return fs_create_directory(path);
     }
 
@@ -569,19 +578,71 @@ uint kernel_service(uint cs, uint service, lp_t lparam)
       fs_entry_t o_entry;
       uchar path[MAX_PATH];
       uint result = 0;
-      lmemcpy(lp(&fi), lparam, lsizeof(fi));
-      lmemcpy(lp(path), fi.path, lsizeof(path));
+      lmem_copy(lp(&fi), lparam, sizeof(fi));
+      lmem_copy(lp(path), fi.path, sizeof(path));
       result = fs_list(&entry, path, fi.n);
       strcpy_s(o_entry.name, entry.name, sizeof(o_entry.name));
       o_entry.flags = entry.flags;
       o_entry.size = entry.size;
-      lmemcpy(fi.entry, lp(&o_entry), lsizeof(o_entry));
+      o_entry.time = entry.time;
+      lmem_copy(fi.entry, lp(&o_entry), sizeof(o_entry));
+      return result;
+    }
+
+    case SYSCALL_FS_READDIR: {
+      syscall_fsreaddir_t fi;
+      uchar path[MAX_PATH];
+      uint cookie = 0;
+      uint result = 0;
+      lmem_copy(lp(&fi), lparam, sizeof(fi));
+      lmem_copy(lp(path), fi.path, sizeof(path));
+      lmem_copy(lp(&cookie), fi.cookie, sizeof(cookie));
+      result = fs_readdir(fi.entries, fi.n, path, &cookie);
+      lmem_copy(fi.cookie, lp(&cookie), sizeof(cookie));
       return result;
     }
 
     case SYSCALL_FS_FORMAT:
       return fs_format(lmem_getbyte(lparam));
 
+    case SYSCALL_FS_OPEN: {
+      syscall_fsopen_t fi;
+      uchar path[MAX_PATH];
+      lmem_copy(lp(&fi), lparam, sizeof(fi));
+      lmem_copy(lp(path), fi.path, sizeof(path));
+      return fs_open(path, fi.flags);
+    }
+
+    case SYSCALL_FS_READ: {
+      syscall_fshandle_t fi;
+      lmem_copy(lp(&fi), lparam, sizeof(fi));
+      return fs_read(fi.handle, fi.buff, fi.count);
+    }
+
+    case SYSCALL_FS_WRITE: {
+      syscall_fshandle_t fi;
+      lmem_copy(lp(&fi), lparam, sizeof(fi));
+      return fs_write(fi.handle, fi.buff, fi.count);
+    }
+
+    case SYSCALL_FS_SEEK: {
+      syscall_fsseek_t fi;
+      lmem_copy(lp(&fi), lparam, sizeof(fi));
+      return fs_seek(fi.handle, fi.offset);
+    }
+
+    case SYSCALL_FS_CLOSE: {
+      uint handle = 0;
+      lmem_copy(lp(&handle), lparam, sizeof(handle));
+      return fs_close(handle);
+    }
+
+    case SYSCALL_FS_READ_ASYNC: {
+      syscall_fsasync_t fi;
+      lmem_copy(lp(&fi), lparam, sizeof(fi));
+      return fs_read_async(fi.handle, fi.buff, fi.count, fi.done);
+    }
+
     case SYSCALL_CLK_GET_TIME: {
       time_t t;
       uchar BCDtime[3];
@@ -593,12 +654,12 @@ uint kernel_service(uint cs, uint service, lp_t lparam)
       t.year   = BCD_to_int(BCDdate[0]) + 2000;
       t.month  = BCD_to_int(BCDdate[1]);
       t.day    = BCD_to_int(BCDdate[2]);
-      lmemcpy(lparam, lp(&t), lsizeof(t));
+      lmem_copy(lparam, lp(&t), sizeof(t));
       return 0;
     }
 
     case SYSCALL_CLK_GET_MILISEC: {
-      lmemcpy(lparam, lp(&system_timer_ms), lsizeof(system_timer_ms));
+      lmem_copy(lparam, lp(&system_timer_ms), sizeof(system_timer_ms));
       return 0;
     }
 
@@ -607,10 +668,10 @@ uint kernel_service(uint cs, uint service, lp_t lparam)
       uint8_t addr[4];
       uint8_t buff[512];
       uint result = 0;
-      lmemcpy(lp(&no), lparam, lsizeof(no));
+      lmem_copy(lp(&no), lparam, sizeof(no));
       result = net_recv(addr, buff, no.size);
-      lmemcpy(no.addr, lp(addr), lsizeof(addr));
-      lmemcpy(no.buff, lp(buff), (ul_t)no.size);
+      lmem_copy(no.addr, lp(addr), sizeof(addr));
+      lmem_copy(no.buff, lp(buff), no.size);
       return result;
     }
 
@@ -618,9 +679,9 @@ uint kernel_service(uint cs, uint service, lp_t lparam)
       syscall_netop_t no;
       uint8_t addr[4];
       uint8_t buff[512];
-      lmemcpy(lp(&no), lparam, lsizeof(no));
-      lmemcpy(lp(addr), no.addr, lsizeof(addr));
-      lmemcpy(lp(buff), no.buff, (ul_t)no.size);
+      lmem_copy(lp(&no), lparam, sizeof(no));
+      lmem_copy(lp(addr), no.addr, sizeof(addr));
+      lmem_copy(lp(buff), no.buff, no.size);
       return net_send(addr, buff, no.size);
     }
   }
@@ -783,13 +844,20 @@ void kernel_time_tick()
   /* Turn off floppy disk motors. Need to do this
    * manually since some computers use the default
    * PIT handler to control this, but this handler
-   * is now being used only for timer purposes */
+   * is now being used only for timer purposes.
+   * Motors of both disks are turned off at once, so wait until
+   * cached changes of both are written, see fs_cache_idle */
   for(i=0; i<2; i++) {
     if(disk_info[i].last_access != 0 &&
-      system_timer_ms-disk_info[i].last_access > 3000) {
-        turn_off_fd_motors();
+      system_timer_ms-disk_info[i].last_access > 3000 &&
+      !fs_cache_dirty(disk_info[0].id) &&
+      !fs_cache_dirty(disk_info[1].id)) {
+        fdc_motors_off();
         debugstr("Turn off floppy disk motors\n\r");
         disk_info[i].last_access = 0;
+        /* Disks can be replaced now */
+        disk_info[0].cached = 0;
+        disk_info[1].cached = 0;
       i++;
     }
   }
@@ -840,8 +908,6 @@ void kernel()
   strcpy_s(disk_info[3].name, "hd1", sizeof(disk_info[3].name));
 
   /* Initialize hardware related disks info */
-  debugstr("Disk auxiliar buffer at: %x\n\r", disk_buff);
-
   for(i=0; i<MAX_DISK; i++) {
     n = index_to_disk(i);
 
@@ -856,10 +922,11 @@ void kernel()
         (1048576L / (ul_t)SECTOR_SIZE);
 
       disk_info[i].last_access = system_timer_ms;
+      disk_info[i].lba = get_disk_lba(n);
 
-      debugstr("DISK (%x : size=%U MB sect_per_track=%d, sides=%d, cylinders=%d)\n\r",
+      debugstr("DISK (%x : size=%U MB sect_per_track=%d, sides=%d, cylinders=%d, lba=%d)\n\r",
         n, disk_info[i].size, disk_info[i].sectors, disk_info[i].sides,
-        disk_info[i].cylinders);
+        disk_info[i].cylinders, disk_info[i].lba);
 
     } else {
       /* Failed. Do not use this disk */
@@ -868,6 +935,7 @@ void kernel()
       disk_info[i].cylinders = 0;
       disk_info[i].size = 0;
       disk_info[i].last_access = 0;
+      disk_info[i].lba = 0;
     }
   }
 
@@ -886,6 +954,12 @@ void kernel()
   /* Init PCI */
   pci_init();
 
+  /* Init native ATA disks access */
+  ata_init();
+
+  /* Init native floppy disks access */
+  fdc_init();
+
   /* Init network */
   net_init();
 
@@ -18,20 +18,42 @@
 /* Size of a disk sector */
 #define SECTOR_SIZE 512
 
-/* We need this buffer to be inside a 64KB bound
- * to avoid DMA error */
-extern uchar disk_buff[SECTOR_SIZE];
+/* Disk cache location in far memory and number of cached sectors.
+ * It must not cross a 64KB bound either */
+#define DCACHE_ADDR     0x00028000L
+#define DCACHE_NSECTORS 64
+
+/* Floppy disk track buffer location in far memory and size.
+ * It holds a whole 1.44MB disk cylinder, and must not cross
+ * a 64KB bound */
+#define FDC_TRACK_ADDR  0x00030000L
+#define FDC_TRACK_SIZE  0x00004800L
+
+/* Bounce buffer location in far memory and number of sectors.
+ * BIOS disk transfers must not cross a 64KB bound, to avoid DMA
+ * error, so the parts of a transfer which would cross it are done
+ * through this buffer, which does not cross it either */
+#define BOUNCE_ADDR     0x00034800L
+#define BOUNCE_NSECTORS 32
+
+/* Read-ahead buffer location in far memory and max number of sectors */
+#define READAHEAD_ADDR     0x00038800L
+#define READAHEAD_NSECTORS 32
 
 struct diskinfo {
     uint  id;          /* Disk id */
     uchar name[4];     /* Disk name */
     uint  fstype;      /* File system type: see ulib.h */
-    ul_t  fssize;      /* Number of blocks in file system */
+    ul_t  fssize;      /* File system size in BLOCK_SIZE units */
     uint  sectors;
     uint  sides;
     uint  cylinders;
     ul_t  size;        /* Disk size (MB) */
     ul_t  last_access; /* Last accessed time (system ms) */
+    uint  lba;         /* Disk supports int 0x13 extensions */
+    uint  ata;         /* Native ATA device (see ata.h), 0 to use BIOS */
+    uint  fdc;         /* Native floppy driver used (see fdc.h) */
+    uint  cached;      /* Cached data is valid: cleared when motors stop */
 } disk_info[MAX_DISK];
 
 extern uchar system_disk; /* System disk */
@@ -13,6 +13,7 @@
 #define MAX_PCI_DEVICE 16
 static uint pci_count = 0;
 pci_device_t pci_devices[MAX_PCI_DEVICE];
+static uint32_t pci_addr[MAX_PCI_DEVICE]; /* Config address of devices */
 
 /*
  * Read config
@@ -24,6 +25,16 @@ static uint32_t pci_read_config(uint32_t pci_dev, uint8_t offset)
   return inl(PCI_CONFIG_DATA_PORT);
 }
 
+/*
+ * Write config
+ */
+static void pci_write_config(uint32_t pci_dev, uint8_t offset, uint32_t value)
+{
+  uint32_t data = 0x80000000L | pci_dev | (ul_t)(offset & 0xFC);
+  outl(data, PCI_CONFIG_ADDR_PORT);
+  outl(value, PCI_CONFIG_DATA_PORT);
+}
+
 /*
  * Scan devices in bus 0
  */
@@ -53,6 +64,7 @@ void pci_init()
       }
 
       /* Read device */
+      pci_addr[pci_count] = pci_dev_addr;
       p = (uint32_t *)&pci_devices[pci_count];
 
       for(i=0; i<sizeof(pci_device_t); i+=4) {
@@ -90,3 +102,30 @@ pci_device_t* pci_find_device(uint16_t vendor, uint16_t device)
   }
   return 0;
 }
+
+/*
+ * Find device in bus 0 by class
+ * Previous initialization is required
+ */
+pci_device_t* pci_find_class(uint8_t class_code, uint8_t subclass)
+{
+  uint i = 0;
+  for(i=0; i<pci_count; i++) {
+    if(class_code==pci_devices[i].class_code &&
+      subclass==pci_devices[i].subclass) {
+      return &pci_devices[i];
+    }
+  }
+  return 0;
+}
+
+/*
+ * Enable bus mastering
+ */
+void pci_enable_bus_master(pci_device_t* dev)
+{
+  uint i = dev - pci_devices;
+  dev->command |= 0x0004;
+  pci_write_config(pci_addr[i], 0x04,
+    pci_read_config(pci_addr[i], 0x04) | 0x0004);
+}
@@ -47,5 +47,15 @@ void pci_init();
  */
 pci_device_t* pci_find_device(uint16_t vendor, uint16_t device);
 
+/*
+ * Find device by class and subclass
+ */
+pci_device_t* pci_find_class(uint8_t class_code, uint8_t subclass);
+
+/*
+ * Enable device bus mastering (DMA)
+ */
+void pci_enable_bus_master(pci_device_t* dev);
+
 
 #endif   /* _PCI_H */
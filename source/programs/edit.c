@@ -260,18 +260,26 @@ uint main(uint argc, uchar* argv[])
   /* Load file or show error */
   if(n<ERROR_ANY && (entry.flags & FST_FILE)) {
     ul_t offset = 0;
-    uchar cbuff[512];
+    uint handle = 0;
     setlc(buff, entry.size, 0);
     buff_size = entry.size;
-    while(result = read_file(cbuff, argv[1], (uint)offset, sizeof(cbuff))) {
+    handle = open_file(argv[1], 0);
+    if(handle >= ERROR_ANY) {
+      lmfree(buff);
+      putstr("Can't open file %s (error=%x)\n\r", argv[1], handle);
+      return 1;
+    }
+    while(result = read_handle(handle, buff + offset,
+      entry.size - (uint)offset)) {
       if(result >= ERROR_ANY) {
+        close_handle(handle);
         lmfree(buff);
         putstr("Can't read file %s (error=%x)\n\r", argv[1], result);
         return 1;
       }
-      lmemcpy(buff + offset, lp(cbuff), (ul_t)result);
       offset += result;
     }
+    close_handle(handle);
     if(offset != entry.size) {
       lmfree(buff);
       putstr("Can't read file (readed %d bytes, expected %d)\n\r",
@@ -350,14 +358,11 @@ uint main(uint argc, uchar* argv[])
 
     /* Key F1: Save */
     } else if(k == KEY_F1) {
-      ul_t offset = 0;
-      uchar cbuff[512];
-      result = 0;
-      while(offset<buff_size && result<ERROR_ANY) {
-        ul_t to_copy = min(sizeof(cbuff), buff_size-offset);
-        lmemcpy(lp(cbuff), buff + offset, to_copy);
-        result = write_file(cbuff, argv[1], (uint)offset, (uint)to_copy, FWF_CREATE | FWF_TRUNCATE);
-        offset += to_copy;
+      uint handle = open_file(argv[1], FWF_CREATE | FWF_TRUNCATE);
+      result = handle;
+      if(handle < ERROR_ANY) {
+        result = write_handle(handle, buff, (uint)buff_size);
+        close_handle(handle);
       }
 
       /* Update state indicator */
@@ -440,16 +440,17 @@ uint encode_data(uchar* buffer, uint offset, uchar type, uint value)
 }
 
 /*
- * Given a file and offset, returns a file line and offset to next line start
+ * Given an open file and offset, returns a file line and offset to next line start
  */
-static uint read_line(uchar* buff, uint buff_size, uchar* file, uint offset)
+static uint read_line(uchar* buff, uint buff_size, uint handle, uint offset)
 {
   uint i = 0;
   uint readed = 0;
 
   /* Clear buffer and read */
   memset(buff, 0, buff_size);
-  readed = read_file(buff, file, offset, buff_size);
+  seek_handle(handle, offset);
+  readed = read_handle(handle, lp(buff), buff_size);
 
   /* Return on error */
   if(readed >= ERROR_ANY) {
@@ -638,7 +639,8 @@ uint main(uint argc, uchar* argv[])
   uint i=0, j=0;
   uchar ofile[14];
 
-  /* Input file buffer and offset */
+  /* Input file handle, buffer and offset */
+  uint  fhandle = 0;
   uchar fbuff[2048];
   uint  foffset = 0;
   uint  fline = 1;
@@ -671,8 +673,16 @@ uint main(uint argc, uchar* argv[])
   /* Clear references table */
   memset(s_ref, 0, sizeof(s_ref));
 
+  /* Open input file */
+  fhandle = open_file(argv[1], 0);
+  if(fhandle >= ERROR_ANY) {
+    putstr("Error opening input file\n\r");
+    debugstr("Error (%x) opening input file (%s)\n\r", fhandle, argv[1]);
+    return 1;
+  }
+
   /* Process input file line by line */
-  while((foffset=read_line(fbuff, sizeof(fbuff), argv[1], foffset))!=EOF) {
+  while((foffset=read_line(fbuff, sizeof(fbuff), fhandle, foffset))!=EOF) {
     uint   tokc = 0;
     uchar* tokv[32];
 
@@ -849,6 +859,8 @@ uint main(uint argc, uchar* argv[])
     }
   }
 
+  close_handle(fhandle);
+
   /* Write output file */
   if(ooffset != 0) {
     debugstr("Write file: %s, %ubytes\n\r", ofile, ooffset);
@@ -30,6 +30,8 @@
 #define SYSCALL_LMEM_FREE               0x0049
 #define SYSCALL_LMEM_GET                0x004A
 #define SYSCALL_LMEM_SET                0x004B
+#define SYSCALL_LMEM_COPY               0x004C
+#define SYSCALL_LMEM_FILL               0x004D
 #define SYSCALL_FS_GET_INFO             0x0050
 #define SYSCALL_FS_GET_ENTRY            0x0051
 #define SYSCALL_FS_READ_FILE            0x0052
@@ -40,6 +42,14 @@
 #define SYSCALL_FS_CREATE_DIRECTORY     0x0057
 #define SYSCALL_FS_LIST                 0x0058
 #define SYSCALL_FS_FORMAT               0x0059
+#define SYSCALL_FS_OPEN                 0x005A
+#define SYSCALL_FS_READ                 0x005B
+#define SYSCALL_FS_WRITE                0x005C
+#define SYSCALL_FS_SEEK                 0x005D
+#define SYSCALL_FS_CLOSE                0x005E
+#define SYSCALL_FS_READ_ASYNC           0x005F
+/* 0x0050-0x005F is full: more FS calls use 0x0068-0x006F */
+#define SYSCALL_FS_READDIR              0x0068
 #define SYSCALL_CLK_GET_TIME            0x0060
 #define SYSCALL_CLK_GET_MILISEC         0x0061
 #define SYSCALL_NET_RECV                0x0070
@@ -77,6 +87,29 @@ typedef struct {
   uint               flags;
 } syscall_fsrwfile_t;
 
+typedef struct {
+  lp_t               path; /* str */
+  uint               flags;
+} syscall_fsopen_t;
+
+typedef struct {
+  uint               handle;
+  lp_t               buff; /* byte[] */
+  uint               count;
+} syscall_fshandle_t;
+
+typedef struct {
+  uint               handle;
+  uint               offset;
+} syscall_fsseek_t;
+
+typedef struct {
+  uint               handle;
+  lp_t               buff; /* byte[] */
+  uint               count;
+  lp_t               done; /* uint* */
+} syscall_fsasync_t;
+
 typedef struct {
   lp_t               src; /* str */
   lp_t               dst; /* str */
@@ -88,6 +121,13 @@ typedef struct {
   uint               n;
 } syscall_fslist_t;
 
+typedef struct {
+  lp_t               entries; /* fs_entry_t[] */
+  uint               n;
+  lp_t               path; /* str */
+  lp_t               cookie; /* uint */
+} syscall_fsreaddir_t;
+
 typedef struct {
   uint               x;
   uint               y;
@@ -107,6 +147,13 @@ typedef struct {
   ul_t               n;
 } syscall_lmem_t;
 
+typedef struct {
+  lp_t               dst;
+  lp_t               src;   /* Source of LMEM_COPY */
+  ul_t               n;
+  uint               value; /* Value of LMEM_FILL */
+} syscall_lmemop_t;
+
 typedef struct {
   lp_t               addr; /* uint8_t[4] */
   lp_t               buff; /* byte[] */
@@ -710,27 +710,12 @@ void mfree(void* ptr)
  */
 ul_t lmemcpy(lp_t dst, lp_t src, ul_t size)
 {
-  ul_t i = 0;
-  uint rdir = 0;
-  syscall_lmem_t ldst;
-  syscall_lmem_t lsrc;
-  lsrc.n = 0;
-
-  if(src > dst) {
-    rdir = 0;
-  } else {
-    rdir = 1;
-  }
-
-  for(i=0; i<size; i++) {
-    lp_t c = rdir ? size-1L-i : i;
-    lsrc.dst = src + c;
-    ldst.dst = dst + c;
-    ldst.n = syscall(SYSCALL_LMEM_GET, lp(&lsrc));
-    syscall(SYSCALL_LMEM_SET, lp(&ldst));
-  }
-
-  return i;
+  syscall_lmemop_t lm;
+  lm.dst = dst;
+  lm.src = src;
+  lm.n = size;
+  syscall(SYSCALL_LMEM_COPY, lp(&lm));
+  return size;
 }
 
 /*
@@ -738,15 +723,12 @@ ul_t lmemcpy(lp_t dst, lp_t src, ul_t size)
  */
 ul_t lmemset(lp_t dest, uchar value, ul_t size)
 {
-  ul_t i = 0;
-  syscall_lmem_t lm;
-  lm.n = value;
-
-  for(i=0; i<size; i++) {
-    lm.dst = dest + i;
-    syscall(SYSCALL_LMEM_SET, lp(&lm));
-  }
-  return i;
+  syscall_lmemop_t lm;
+  lm.dst = dest;
+  lm.n = size;
+  lm.value = value;
+  syscall(SYSCALL_LMEM_FILL, lp(&lm));
+  return size;
 }
 
 /*
@@ -824,6 +806,73 @@ uint write_file(uchar* buff, uchar* path, uint offset, uint count, uint flags)
   return syscall(SYSCALL_FS_WRITE_FILE, lp(&fi));
 }
 
+/*
+ * Open file
+ */
+uint open_file(uchar* path, uint flags)
+{
+  syscall_fsopen_t fi;
+  fi.path = lp(path);
+  fi.flags = flags;
+  return syscall(SYSCALL_FS_OPEN, lp(&fi));
+}
+
+/*
+ * Read open file
+ */
+uint read_handle(uint handle, lp_t buff, uint count)
+{
+  syscall_fshandle_t fi;
+  fi.handle = handle;
+  fi.buff = buff;
+  fi.count = count;
+  return syscall(SYSCALL_FS_READ, lp(&fi));
+}
+
+/*
+ * Read open file asynchronously
+ */
+uint read_handle_async(uint handle, lp_t buff, uint count, uint* done)
+{
+  syscall_fsasync_t fi;
+  fi.handle = handle;
+  fi.buff = buff;
+  fi.count = count;
+  fi.done = lp(done);
+  return syscall(SYSCALL_FS_READ_ASYNC, lp(&fi));
+}
+
+/*
+ * Write open file
+ */
+uint write_handle(uint handle, lp_t buff, uint count)
+{
+  syscall_fshandle_t fi;
+  fi.handle = handle;
+  fi.buff = buff;
+  fi.count = count;
+  return syscall(SYSCALL_FS_WRITE, lp(&fi));
+}
+
+/*
+ * Set open file position
+ */
+uint seek_handle(uint handle, uint offset)
+{
+  syscall_fsseek_t fi;
+  fi.handle = handle;
+  fi.offset = offset;
+  return syscall(SYSCALL_FS_SEEK, lp(&fi));
+}
+
+/*
+ * Close open file
+ */
+uint close_handle(uint handle)
+{
+  return syscall(SYSCALL_FS_CLOSE, lp(&handle));
+}
+
 /*
  * Move entry
  */
@@ -874,6 +923,19 @@ uint list(fs_entry_t* entry, uchar* path, uint n)
   return syscall(SYSCALL_FS_LIST, lp(&fi));
 }
 
+/*
+ * Read dir entries
+ */
+uint readdir(fs_entry_t* entries, uint n, uchar* path, uint* cookie)
+{
+  syscall_fsreaddir_t fi;
+  fi.entries = lp(entries);
+  fi.n = n;
+  fi.path = lp(path);
+  fi.cookie = lp(cookie);
+  return syscall(SYSCALL_FS_READDIR, lp(&fi));
+}
+
 /*
  * Create filesystem in disk
  */
@@ -438,6 +438,7 @@ lp_t lp(void* ptr);
 
 /*
  * Copy size bytes from src[src_offs] to dst[dst_offs] (far memory)
+ * Ranges can overlap
  */
 ul_t lmemcpy(lp_t dst, lp_t src, ul_t size);
 
@@ -502,6 +503,7 @@ typedef struct {
   uchar name[15];
   uchar flags;
   uint  size; /* bytes for files, items for directories */
+  ul_t  time; /* last modification, fs time format */
 } fs_entry_t;
 
 #define MAX_PATH 72
@@ -509,6 +511,7 @@ typedef struct {
 /* fs_info_t.fs_type types */
 #define FS_TYPE_UNKNOWN 0x000
 #define FS_TYPE_NSFS    0x001
+#define FS_TYPE_NSFS_RO 0x002 /* Older NSFS revision. Read only */
 
  typedef struct {
   uchar name[4];
@@ -562,6 +565,62 @@ uint read_file(uchar* buff, uchar* path, uint offset, uint count);
   */
 uint write_file(uchar* buff, uchar* path, uint offset, uint count, uint flags);
 
+/*
+ * Open file
+ * Files can be open to be read or written sequentially,
+ * without looking up path again for each access.
+ * Flags are the same than in write_file.
+ * If FWF_TRUNCATE is set, file size becomes 0.
+ * Returns a file handle, or:
+ * - ERROR_NOT_FOUND if path does not exist or it's a directory
+ * - ERROR_NO_SPACE if too many files are open
+ * Open files are closed when the program finishes
+ */
+uint open_file(uchar* path, uint flags);
+
+/*
+ * Read open file
+ * Output: buff
+ * Reads count bytes of file handle starting at its position,
+ * and advances position. buff can be far memory. Use lp() to
+ * pass a near buffer.
+ * Returns number of readed bytes or an error code
+ */
+uint read_handle(uint handle, lp_t buff, uint count);
+
+/*
+ * Read open file asynchronously
+ * Output: buff, done
+ * Starts reading up to count bytes of file handle at its position,
+ * and advances position. done becomes 0, and then 1 once data is
+ * available in buff, or an error code if it fails. Meanwhile, the
+ * program can do other things, but buff must not be used.
+ * Returns number of bytes being read, which can be less than count
+ * before the end of file, or an error code
+ */
+uint read_handle_async(uint handle, lp_t buff, uint count, uint* done);
+
+/*
+ * Write open file
+ * Writes count bytes of file handle starting at its position,
+ * and advances position. buff can be far memory.
+ * If target file is not big enough, its size is increased.
+ * Returns number of written bytes or an error code
+ */
+uint write_handle(uint handle, lp_t buff, uint count);
+
+/*
+ * Set open file position
+ * Returns new position or ERROR_NOT_FOUND
+ */
+uint seek_handle(uint handle, uint offset);
+
+/*
+ * Close open file
+ * Returns 0 on success
+ */
+uint close_handle(uint handle);
+
 /*
  * Move entry
  * In the case of directories, they are recursively moved
@@ -610,6 +669,19 @@ uint create_directory(uchar* path);
  */
 uint list(fs_entry_t* entry, uchar* path, uint n);
 
+/*
+ * Read directory entries
+ * Output: entries (array of n fs_entry_t)
+ * Reads up to n items of path directory, starting at item *cookie,
+ * and advances *cookie past them. Set *cookie to 0 to start.
+ * If the directory is modified between calls, items may be
+ * skipped or repeated
+ * Returns:
+ * - ERROR_NOT_FOUND if path does not exist or is not a directory
+ * - number of entries read otherwise, 0 after the last one
+ */
+uint readdir(fs_entry_t* entries, uint n, uchar* path, uint* cookie);
+
 /*
  * Create filesystem in disk
  * Deletes all files, creates NSFS filesystem